@@ -0,0 +1,320 @@
+#!/bin/bash
+#
+# Self-contained udp_flood -> udp_sink benchmark on a single host.
+#
+# Creates a veth pair across two network namespaces, so packets
+# traverse a real netdev RX path (unlike loopback), configures
+# RPS/XPS/GRO, and runs every combination of sink and flood engine
+# with the programs pinned to CPUs (via src/netns_exec).
+#
+# Author: Jesper Dangaard Brouer <netoptimizer@brouer.com>
+# License: GPLv2
+#
+basedir=`dirname $0`
+BINDIR=${BINDIR:-$basedir/../src}
+
+NS_SND=udpbench_snd
+NS_RCV=udpbench_rcv
+DEV_SND=vbench0
+DEV_RCV=vbench1
+IP_SND=10.111.0.1
+IP_RCV=10.111.0.2
+
+function usage() {
+    echo ""
+    echo "Usage: $0 [-vh] [options]"
+    echo "  --sink LIST      : (\$SINK)       udp_sink engines (default: recvmmsg,recvmsg,recvfrom,read)"
+    echo "  --flood LIST     : (\$FLOOD)      udp_flood engines (default: sendmmsg,sendmsg,sendto)"
+    echo "  --sink-cpu N     : (\$SINK_CPU)   Pin udp_sink to CPU"
+    echo "  --flood-cpu N    : (\$FLOOD_CPU)  Pin udp_flood to CPU"
+    echo "  --prio N         : (\$PRIO)       SCHED_FIFO prio for both programs"
+    echo "  --rps MASK       : (\$RPS)        RPS cpumask on RX veth (hex, 0=off)"
+    echo "  --xps MASK       : (\$XPS)        XPS cpumask on TX veth (hex, 0=off)"
+    echo "  --gro on|off     : (\$GRO)        GRO on RX veth (needs ethtool)"
+    echo "  --queues N       : (\$QUEUES)     Number of veth RX/TX queues"
+    echo "  -c | --count N   : (\$COUNT)      Packets per sink run"
+    echo "  -r | --repeat N  : (\$REPEAT)     Runs per combination"
+    echo "  -m | --payload N : (\$PAYLOAD)    UDP payload size"
+    echo "  -o | --output F  : (\$OUTPUT)     Append results as CSV to file"
+    echo "  --keep           : (\$KEEP)       Keep netns/veth after run"
+    echo "  -f | --flush     : (\$FLUSH)      Only remove netns/veth"
+    echo "  --dry-run        : (\$DRYRUN)     Dry-run only (echo commands)"
+    echo "  -v | --verbose   : (\$VERBOSE)    verbose"
+    echo ""
+}
+
+## -- General shell logging cmds --
+function err() {
+    local exitcode=$1
+    shift
+    echo -e "ERROR: $@" >&2
+    exit $exitcode
+}
+
+function warn() {
+    echo -e "WARN : $@" >&2
+}
+
+function info() {
+    if [[ -n "$VERBOSE" ]]; then
+	echo "# $@"
+    fi
+}
+
+function call() {
+    if [[ -n "$VERBOSE" ]]; then
+	echo "$@"
+    fi
+    if [[ -n "$DRYRUN" ]]; then
+	return
+    fi
+    "$@" || err 4 "Exec error($?) occurred cmd: \"$@\""
+}
+
+# Write a sysfs file inside a netns (netns has its own /sys view)
+function netns_sysfs_write() {
+    local ns=$1
+    local file=$2
+    local value=$3
+    call ip netns exec $ns sh -c "echo $value > $file"
+}
+
+if [ "$EUID" -ne 0 ]; then
+    err 1 "Need root for creating network namespaces"
+fi
+
+# Using external program "getopt" to get --long-options
+OPTIONS=$(getopt -o vhfc:r:m:o: \
+    --long verbose,help,flush,keep,dry-run,sink:,flood:,sink-cpu:,flood-cpu:,prio:,rps:,xps:,gro:,queues:,count:,repeat:,payload:,output: -- "$@")
+if (( $? != 0 )); then
+    usage
+    err 2 "Error calling getopt"
+fi
+eval set -- "$OPTIONS"
+
+# Default settings, pin programs to different CPUs when available
+NCPU=$(nproc)
+SINK=recvmmsg,recvmsg,recvfrom,read
+FLOOD=sendmmsg,sendmsg,sendto
+if (( NCPU > 2 )); then
+    SINK_CPU=1
+    FLOOD_CPU=2
+else
+    SINK_CPU=0
+    FLOOD_CPU=$((NCPU - 1))
+fi
+RPS=0
+XPS=0
+QUEUES=1
+COUNT=1000000
+REPEAT=3
+PAYLOAD=18
+PORT=6666
+
+##  --- Parse command line arguments / parameters ---
+while true; do
+    case "$1" in
+        -v | --verbose)
+          export VERBOSE=yes
+	  shift
+          ;;
+        --dry-run )
+          export DRYRUN=yes
+          export VERBOSE=yes
+	  shift
+          ;;
+        -f | --flush )
+          export FLUSH=yes
+	  shift
+          ;;
+        --keep )
+          export KEEP=yes
+	  shift
+          ;;
+        --sink )
+          export SINK=$2
+	  shift 2
+          ;;
+        --flood )
+          export FLOOD=$2
+	  shift 2
+          ;;
+        --sink-cpu )
+          export SINK_CPU=$2
+	  shift 2
+          ;;
+        --flood-cpu )
+          export FLOOD_CPU=$2
+	  shift 2
+          ;;
+        --prio )
+          export PRIO=$2
+	  shift 2
+          ;;
+        --rps )
+          export RPS=$2
+	  shift 2
+          ;;
+        --xps )
+          export XPS=$2
+	  shift 2
+          ;;
+        --gro )
+          export GRO=$2
+	  shift 2
+          ;;
+        --queues )
+          export QUEUES=$2
+	  shift 2
+          ;;
+        -c | --count )
+          export COUNT=$2
+	  shift 2
+          ;;
+        -r | --repeat )
+          export REPEAT=$2
+	  shift 2
+          ;;
+        -m | --payload )
+          export PAYLOAD=$2
+	  shift 2
+          ;;
+        -o | --output )
+          export OUTPUT=$2
+	  shift 2
+          ;;
+	-- )
+	  shift
+	  break
+	  ;;
+        -h | --help )
+          usage;
+	  exit 0
+	  ;;
+	* )
+	  shift
+	  break
+	  ;;
+    esac
+done
+
+function netns_cleanup() {
+    info "Remove netns $NS_SND and $NS_RCV (deletes veth pair)"
+    ip netns del $NS_SND 2>/dev/null
+    ip netns del $NS_RCV 2>/dev/null
+}
+
+function netns_setup() {
+    netns_cleanup
+    call ip netns add $NS_SND
+    call ip netns add $NS_RCV
+    call ip link add $DEV_SND numtxqueues $QUEUES numrxqueues $QUEUES \
+	netns $NS_SND type veth peer name $DEV_RCV \
+	numtxqueues $QUEUES numrxqueues $QUEUES netns $NS_RCV
+    call ip -n $NS_SND addr add $IP_SND/24 dev $DEV_SND
+    call ip -n $NS_RCV addr add $IP_RCV/24 dev $DEV_RCV
+    call ip -n $NS_SND link set lo up
+    call ip -n $NS_RCV link set lo up
+    call ip -n $NS_SND link set $DEV_SND up
+    call ip -n $NS_RCV link set $DEV_RCV up
+}
+
+function tuning_setup() {
+    local q
+
+    # veth GRO also enables NAPI on the RX side
+    if [[ -n "$GRO" ]]; then
+	if command -v ethtool >/dev/null; then
+	    call ip netns exec $NS_RCV ethtool -K $DEV_RCV gro $GRO
+	else
+	    warn "ethtool not found, cannot set GRO $GRO"
+	fi
+    fi
+
+    for (( q = 0; q < QUEUES; q++ )); do
+	netns_sysfs_write $NS_RCV \
+	    /sys/class/net/$DEV_RCV/queues/rx-$q/rps_cpus $RPS
+	# Kernel reject XPS changes on single queue devices, unless set
+	if [[ "$XPS" != "0" ]]; then
+	    netns_sysfs_write $NS_SND \
+		/sys/class/net/$DEV_SND/queues/tx-$q/xps_cpus $XPS
+	fi
+    done
+    info "RPS:$RPS XPS:$XPS GRO:${GRO:-default} queues:$QUEUES"
+}
+
+# Run one sink/flood combination, print average pps and ns/pkt
+function run_one() {
+    local sink=$1
+    local flood=$2
+    local prio_opt=""
+    local out=$(mktemp)
+    local sink_pid flood_pid
+
+    if [[ -n "$PRIO" ]]; then
+	prio_opt="-P $PRIO"
+    fi
+
+    $BINDIR/netns_exec -n $NS_RCV -c $SINK_CPU $prio_opt -- \
+	$BINDIR/udp_sink --$sink -c $COUNT -r $REPEAT -l $PORT > $out &
+    sink_pid=$!
+    sleep 0.2
+
+    # Flood until sink got all runs, sink exit cause ECONNREFUSED
+    $BINDIR/netns_exec -n $NS_SND -c $FLOOD_CPU $prio_opt -- \
+	$BINDIR/udp_flood --$flood -c 2000000000 -m $PAYLOAD -p $PORT \
+	$IP_RCV > /dev/null 2>&1 &
+    flood_pid=$!
+
+    wait $sink_pid
+    kill $flood_pid 2>/dev/null
+    wait $flood_pid 2>/dev/null
+
+    if [[ -n "$VERBOSE" ]]; then
+	cat $out
+    fi
+    # Sink result lines: "name run: N count ns/pkt pps cycles payload"
+    awk -v sink=$sink -v flood=$flood -v csv="$OUTPUT" \
+	-v rps=$RPS -v xps=$XPS -v gro=${GRO:-default} '
+	$2 == "run:" { n++; ns += $5; pps += $6 }
+	END {
+		if (!n) { printf "%-10s %-10s %12s %10s\n", sink, flood,
+			  "FAILED", "-"; exit }
+		printf "%-10s %-10s %12.0f %10.2f\n", sink, flood,
+		       pps / n, ns / n
+		if (csv != "")
+			printf "%s,%s,%s,%s,%s,%.0f,%.2f\n", sink, flood,
+			       rps, xps, gro, pps / n, ns / n >> csv
+	}' $out
+    rm -f $out
+}
+
+if [[ -n "$FLUSH" ]]; then
+    netns_cleanup
+    exit 0
+fi
+
+for prog in netns_exec udp_sink udp_flood; do
+    if [[ ! -x $BINDIR/$prog ]]; then
+	err 3 "Missing $BINDIR/$prog (run make in src/)"
+    fi
+done
+
+if [[ -z "$KEEP" && -z "$DRYRUN" ]]; then
+    trap netns_cleanup EXIT
+fi
+netns_setup
+tuning_setup
+if [[ -n "$DRYRUN" ]]; then
+    exit 0
+fi
+
+echo "# veth $NS_SND/$DEV_SND -> $NS_RCV/$DEV_RCV sink-cpu:$SINK_CPU" \
+     "flood-cpu:$FLOOD_CPU RPS:$RPS XPS:$XPS GRO:${GRO:-default}" \
+     "count:$COUNT repeat:$REPEAT payload:$PAYLOAD"
+printf "%-10s %-10s %12s %10s\n" "sink" "flood" "pps" "ns/pkt"
+for sink in ${SINK//,/ }; do
+    for flood in ${FLOOD//,/ }; do
+	run_one $sink $flood
+    done
+done
@@ -6,7 +6,9 @@
  * Common/shared helper functions
  *
  */
+#define _GNU_SOURCE /* needed for CPU_SET */
 #include <stdint.h>
+#include <sched.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -131,18 +133,38 @@ int time_func(int loops,
 	return 0;
 }
 
-int read_ip_early_demux(void)
+/* Pin calling thread to a CPU, returns 0 or negative errno */
+int pin_to_cpu(int cpu)
+{
+	cpu_set_t cpuset;
+	int err;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+		err = errno;
+		fprintf(stderr, "WARN: cannot pin to CPU:%d: %s\n",
+			cpu, strerror(err));
+		return -err;
+	}
+	return 0;
+}
+
+/* Read integer value from e.g. a /proc/sys file, returns -1 if the
+ * file cannot be read.
+ */
+int read_proc_int(const char *path)
 {
 	char buf[20] = {0};
 	int value, res;
 	FILE *file;
 
-	file = fopen("/proc/sys/net/ipv4/ip_early_demux", "r");
+	file = fopen(path, "r");
 	if (file == NULL) {
 		fprintf(stderr,
-			"WARN: cannot read ip_early_demux errno(%d) ", errno);
+			"WARN: cannot read %s errno(%d) ", path, errno);
 		perror("- fopen");
-		return 0;
+		return -1;
 	}
 
 	if (!fgets(buf, sizeof(buf), file)) {
@@ -150,10 +172,10 @@ int read_ip_early_demux(void)
 		fclose(file);
 		exit(EXIT_FAIL_FILEACCESS);
 	}
-	res = sscanf(buf,"%u",&value);
+	res = sscanf(buf,"%d",&value);
 	if (res != 1) {
 		fprintf(stderr,
-			"ERROR: cannot parse ip_early_demux errno(%d) ", errno);
+			"ERROR: cannot parse %s errno(%d) ", path, errno);
 		if (res == EOF)
 			perror("sscanf");
 		fclose(file);
@@ -163,6 +185,99 @@ int read_ip_early_demux(void)
 	return value;
 }
 
+/* Write integer value to e.g. a /proc/sys file (needs root) */
+int write_proc_int(const char *path, int value)
+{
+	FILE *file;
+	int res;
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr,
+			"ERROR: cannot write %s errno(%d) ", path, errno);
+		perror("- fopen");
+		return -1;
+	}
+	res = fprintf(file, "%d\n", value);
+	if (fclose(file) || res < 0) {
+		fprintf(stderr, "ERROR: cannot write %d to %s ", value, path);
+		perror("- fclose");
+		return -1;
+	}
+	return 0;
+}
+
+/* Read a counter from /proc/net/netstat (or /proc/net/snmp), where
+ * each section is a header line with names followed by a line with
+ * values, e.g. read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+ * "ListenOverflows").  Returns -1 if not found.
+ */
+long long read_netstat_counter(const char *path, const char *section,
+			       const char *name)
+{
+	char names[8192], values[8192];
+	char *n, *v, *save_n = NULL, *save_v = NULL;
+	size_t len = strlen(section);
+	long long value = -1;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr,
+			"WARN: cannot read %s errno(%d) ", path, errno);
+		perror("- fopen");
+		return -1;
+	}
+	while (fgets(names, sizeof(names), file) &&
+	       fgets(values, sizeof(values), file)) {
+		if (strncmp(names, section, len) || names[len] != ':')
+			continue;
+		n = strtok_r(names + len + 1, " \n", &save_n);
+		v = strtok_r(values + len + 1, " \n", &save_v);
+		while (n && v) {
+			if (!strcmp(n, name)) {
+				value = strtoll(v, NULL, 10);
+				break;
+			}
+			n = strtok_r(NULL, " \n", &save_n);
+			v = strtok_r(NULL, " \n", &save_v);
+		}
+		break;
+	}
+	fclose(file);
+	return value;
+}
+
+/* Snapshot TcpExt counters, for printing the change later */
+void tcpext_snapshot(const char * const *names, long long *vals, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		vals[i] = read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					       names[i]);
+}
+
+void tcpext_print_delta(const char * const *names, const long long *vals,
+			int nr)
+{
+	int i;
+
+	printf(" - TcpExt");
+	for (i = 0; i < nr; i++)
+		printf(" %s:%lld", names[i],
+		       read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					    names[i]) - vals[i]);
+	printf("\n");
+}
+
+int read_ip_early_demux(void)
+{
+	int value = read_proc_int(PROC_IP_EARLY_DEMUX);
+
+	return value < 0 ? 0 : value;
+}
+
 void time_bench_record_setting(struct time_bench_record *r)
 {
 	memset(r, 0, sizeof(*r));
@@ -191,6 +306,122 @@ void time_bench_print_stats(struct time_bench_record *r,
 	}
 }
 
+/*** Histogram ***/
+
+void histogram_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline int histogram_index(uint64_t value)
+{
+	int msb;
+
+	if (value < HIST_SUB)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lowest value that lands in bucket idx */
+static uint64_t histogram_bucket_low(int idx)
+{
+	int msb;
+
+	if (idx < HIST_SUB)
+		return idx;
+	msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return (1ULL << msb) +
+		((uint64_t)(idx % HIST_SUB) << (msb - HIST_SUB_BITS));
+}
+
+void histogram_add(struct histogram *h, uint64_t value)
+{
+	h->bucket[histogram_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum   += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Returns lower bound of bucket containing the pct percentile */
+uint64_t histogram_percentile(const struct histogram *h, double pct)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	target = h->count * pct / 100;
+	if (target >= h->count)
+		return h->max;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > target)
+			break;
+	}
+	if (histogram_bucket_low(i) < h->min)
+		return h->min;
+	return histogram_bucket_low(i);
+}
+
+/* One line with count, min/avg/max and percentiles */
+void histogram_print_summary(const struct histogram *h, const char *name,
+			     const char *unit)
+{
+	printf(" %s (%s) count:%lu", name, unit, h->count);
+	if (!h->count) {
+		printf("\n");
+		return;
+	}
+	printf(" min:%lu avg:%.0f max:%lu"
+	       " p50:%lu p90:%lu p99:%lu p99.9:%lu p99.99:%lu\n",
+	       h->min, h->sum / h->count, h->max,
+	       histogram_percentile(h, 50), histogram_percentile(h, 90),
+	       histogram_percentile(h, 99), histogram_percentile(h, 99.9),
+	       histogram_percentile(h, 99.99));
+}
+
+/* Summary followed by all non-empty buckets */
+void histogram_print(const struct histogram *h, const char *name,
+		     const char *unit)
+{
+	uint64_t cumulative = 0;
+	int i;
+
+	histogram_print_summary(h, name, unit);
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		cumulative += h->bucket[i];
+		printf("  %12lu - %-12lu %10lu %6.2f%% %7.3f%%\n",
+		       histogram_bucket_low(i),
+		       (i + 1 < HIST_BUCKETS) ? histogram_bucket_low(i + 1) - 1
+					      : UINT64_MAX,
+		       h->bucket[i], h->bucket[i] * 100.0 / h->count,
+		       cumulative * 100.0 / h->count);
+	}
+}
+
 void print_header(const char *fct, int batch)
 {
 	if (verbose && batch)
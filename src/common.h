@@ -21,6 +21,18 @@ struct pktgen_hdr {
 	uint32_t tv_usec;
 };
 
+/* Payload of udp_pacer: a pktgen header (seq_num is per packet)
+ * followed by pacing info.  All fields in network byte order.
+ */
+struct pacer_hdr {
+	struct pktgen_hdr pgh;
+	uint32_t burst_seq;	/* period/burst number */
+	uint16_t burst_idx;	/* packet index within burst */
+	uint16_t burst_len;
+	uint64_t intended_ns;	/* scheduled send (launch) time */
+	uint64_t actual_ns;	/* time handed to the kernel */
+};
+
 struct time_bench_record
 {
 	/* Stats */
@@ -68,11 +80,54 @@ void time_bench_print_stats(struct time_bench_record *r,
 			    struct params_common *c);
 void time_bench_record_setting(struct time_bench_record *r);
 
+#define PROC_IP_EARLY_DEMUX	"/proc/sys/net/ipv4/ip_early_demux"
+#define PROC_UDP_EARLY_DEMUX	"/proc/sys/net/ipv4/udp_early_demux"
+#define PROC_TCP_FASTOPEN	"/proc/sys/net/ipv4/tcp_fastopen"
+#define TFO_CLIENT_ENABLE	0x1
+#define TFO_SERVER_ENABLE	0x2
+int pin_to_cpu(int cpu);
+int read_proc_int(const char *path);
+int write_proc_int(const char *path, int value);
+int read_ip_early_demux(void);
+
+#define PROC_NET_NETSTAT	"/proc/net/netstat"
+#define PROC_NET_SNMP		"/proc/net/snmp"
+long long read_netstat_counter(const char *path, const char *section,
+			       const char *name);
+void tcpext_snapshot(const char * const *names, long long *vals, int nr);
+void tcpext_print_delta(const char * const *names, const long long *vals,
+			int nr);
+
 char *malloc_payload_buffer(int msg_sz);
 void print_result(uint64_t tsc_cycles, double ns_per_pkt, double pps,
 		  double timesec, int cnt_send, uint64_t tsc_interval);
 void print_header(const char *fct, int batch);
 
+/* Histogram with log2 buckets, each split into linear sub-buckets,
+ * giving max 12.5% relative error over the full uint64_t range.
+ * Intended for latency/jitter distributions in nanosec.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t bucket[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+};
+
+void histogram_init(struct histogram *h);
+void histogram_add(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double pct);
+void histogram_print_summary(const struct histogram *h, const char *name,
+			     const char *unit);
+void histogram_print(const struct histogram *h, const char *name,
+		     const char *unit);
+
 /* Using __builtin_constant_p(x) to ignore cases where the return
  * value is always the same.
  */
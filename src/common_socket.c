@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <string.h> /* memset */
 #include <stdint.h> /* types uintXX_t */
+#include <sys/resource.h> /* setrlimit(2) */
 
 #include "global.h"
 
@@ -77,6 +78,36 @@ socklen_t sockaddr_len(const struct sockaddr_storage *sockaddr)
 	return len_addr;
 }
 
+/* Change port of an already setup sockaddr_in{,6} */
+void sockaddr_set_port(struct sockaddr_storage *addr, uint16_t port)
+{
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+/* Raise the open files soft limit, for tests needing many sockets.
+ * Cannot go beyond the hard limit without privileges.
+ */
+void raise_nofile_limit(unsigned int nr_fds)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	if (rl.rlim_cur >= nr_fds)
+		return;
+	rl.rlim_cur = nr_fds;
+	if (rl.rlim_max < nr_fds)
+		rl.rlim_max = nr_fds;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		fprintf(stderr, "WARN: %s() cannot raise RLIMIT_NOFILE to %u",
+			__func__, nr_fds);
+		perror(" - setrlimit");
+	}
+}
+
 /* Wrapper functions with error handling, for basic socket function, that
  * checks the error codes, and terminate the program with an error
  * msg.  This reduces code size and still do proper error checking.
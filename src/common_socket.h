@@ -36,6 +36,9 @@ void setup_sockaddr(int addr_family, struct sockaddr_storage *addr,
 		    char *ip_string, uint16_t port);
 
 socklen_t sockaddr_len(const struct sockaddr_storage *sockaddr);
+void sockaddr_set_port(struct sockaddr_storage *addr, uint16_t port);
+
+void raise_nofile_limit(unsigned int nr_fds);
 
 /* Memory alloc */
 extern struct  msghdr *malloc_msghdr();
@@ -14,6 +14,7 @@
 #define EXIT_FAIL_REUSEPORT	105
 #define EXIT_FAIL_FILEACCESS	106
 #define EXIT_FAIL_PTHREAD	107
+#define EXIT_FAIL_EXEC		108
 
 #define NANOSEC_PER_SEC 1000000000 /* 10^9 */
 
@@ -0,0 +1,125 @@
+/* -*- c-file-style: "linux" -*-
+ * Author: Jesper Dangaard Brouer <netoptimizer@brouer.com>
+ * License: GPLv2
+ * From: https://github.com/netoptimizer/network-testing
+ */
+static const char *__doc__=
+ " Execute a program inside a named network namespace, pinned to a\n"
+ " CPU and optionally with SCHED_FIFO priority.  Helper for the\n"
+ " bin/netns_udp_bench.sh harness, avoiding the overhead of\n"
+ " 'ip netns exec' (which remounts /sys) and taskset/chrt.\n"
+ "\n"
+ " Usage: netns_exec -n NAME [-c CPU] [-P PRIO] -- PROGRAM [ARGS]\n"
+ ;
+
+#define _GNU_SOURCE /* needed for setns and getopt.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <getopt.h>
+
+#include "global.h"
+#include "common.h"
+
+#define NETNS_RUN_DIR "/var/run/netns"
+
+static const struct option long_options[] = {
+	{"help",	no_argument,		NULL, 'h' },
+	{"netns",	required_argument,	NULL, 'n' },
+	{"cpu",		required_argument,	NULL, 'c' },
+	{"prio",	required_argument,	NULL, 'P' },
+	{"verbose",	optional_argument,	NULL, 'v' },
+	{0, 0, NULL,  0 }
+};
+
+static int usage(char *argv[])
+{
+	int i;
+
+	printf("\nDOCUMENTATION:\n%s\n", __doc__);
+	printf(" Listing options:\n");
+	for (i = 0; long_options[i].name != 0; i++) {
+		printf(" --%-12s", long_options[i].name);
+		if (long_options[i].flag != NULL)
+			printf(" flag (internal value:%d)",
+			       *long_options[i].flag);
+		else
+			printf(" short-option: -%c",
+			       long_options[i].val);
+		printf("\n");
+	}
+	printf("\n");
+	return EXIT_FAIL_OPTION;
+}
+
+static void enter_netns(const char *name)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", NETNS_RUN_DIR, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: cannot open netns %s: %s\n",
+			path, strerror(errno));
+		exit(EXIT_FAIL_FILEACCESS);
+	}
+	if (setns(fd, CLONE_NEWNET) < 0) {
+		fprintf(stderr, "ERROR: setns(%s) failed: %s\n",
+			name, strerror(errno));
+		exit(EXIT_FAIL_EXEC);
+	}
+	close(fd);
+}
+
+static void set_prio(int prio)
+{
+	struct sched_param schedp = { .sched_priority = prio };
+
+	if (sched_setscheduler(0, SCHED_FIFO, &schedp) < 0) {
+		fprintf(stderr, "ERROR: cannot set SCHED_FIFO prio:%d: %s\n",
+			prio, strerror(errno));
+		exit(EXIT_FAIL_EXEC);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char *netns = NULL;
+	int cpu = -1, prio = 0;
+	int c, longindex = 0;
+
+	/* "+" stop at first non-option, the program to execute */
+	while ((c = getopt_long(argc, argv, "+hn:c:P:v::",
+				long_options, &longindex)) != -1) {
+		if (c == 'n') netns   = optarg;
+		if (c == 'c') cpu     = atoi(optarg);
+		if (c == 'P') prio    = atoi(optarg);
+		if (c == 'v') verbose = optarg ? atoi(optarg) : 1;
+		if (c == 'h' || c == '?') return usage(argv);
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "ERROR: Expected program to execute\n");
+		return usage(argv);
+	}
+
+	if (netns)
+		enter_netns(netns);
+	if (cpu >= 0 && pin_to_cpu(cpu) < 0)
+		exit(EXIT_FAIL_EXEC);
+	if (prio)
+		set_prio(prio);
+
+	if (verbose)
+		fprintf(stderr, "netns:%s cpu:%d prio:%d exec:%s\n",
+			netns ? netns : "(none)", cpu, prio, argv[optind]);
+
+	execvp(argv[optind], &argv[optind]);
+	fprintf(stderr, "ERROR: exec %s failed: %s\n",
+		argv[optind], strerror(errno));
+	return EXIT_FAIL_EXEC;
+}
@@ -0,0 +1,667 @@
+/* -*- c-file-style: "linux" -*-
+ * Author: Jesper Dangaard Brouer <netoptimizer@brouer.com>
+ * License: GPLv2
+ * From: https://github.com/netoptimizer/network-testing
+ */
+static const char *__doc__=
+ " TCP request/response benchmark, like netperf TCP_RR and TCP_CRR.\n"
+ "\n"
+ " Server mode (--server) echoes a response to every request, with\n"
+ " the response size requested by the client in the request header.\n"
+ " Client mode keeps --conns connections per thread, each with\n"
+ " --depth pipelined requests outstanding, and reports transactions\n"
+ " per sec and a round-trip time histogram.  With --crr, every\n"
+ " transaction uses a new connection (connect, request, response,\n"
+ " close), and RTT includes the handshake.\n"
+ "\n"
+ " Runs over loopback, or a veth pair across network namespaces\n"
+ " (see netns_exec and bin/netns_udp_bench.sh).\n"
+ ;
+
+#define _GNU_SOURCE /* needed for getopt.h */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "global.h"
+#include "common.h"
+#include "common_socket.h"
+
+/* Each request starts with this header, network byte order */
+struct rr_hdr {
+	uint32_t req_len;	/* total request size, incl. header */
+	uint32_t resp_len;	/* response size server must send */
+};
+
+#define RR_BUF_SZ	65536
+#define MAX_EVENTS	256
+
+/* Global config setting, default values adjustable via getopt_long */
+static int server_mode = 0;
+static int crr_mode = 0;
+static int nr_threads = 1;
+static int nr_conns = 1;	/* client connections per thread */
+static int depth = 1;		/* pipelined requests per connection */
+static uint32_t req_size = 64;
+static uint32_t resp_size = 64;
+static int duration = 5;
+static int nodelay = 1;
+
+static volatile int stop;
+
+static struct option long_options[] = {
+	{"help",	no_argument,		NULL, 'h' },
+	{"server",	no_argument,		NULL, 's' },
+	{"ipv4",	no_argument,		NULL, '4' },
+	{"ipv6",	no_argument,		NULL, '6' },
+	{"port",	required_argument,	NULL, 'p' },
+	{"threads",	required_argument,	NULL, 't' },
+	{"conns",	required_argument,	NULL, 'C' },
+	{"depth",	required_argument,	NULL, 'D' },
+	{"req",		required_argument,	NULL, 'r' },
+	{"resp",	required_argument,	NULL, 'R' },
+	{"duration",	required_argument,	NULL, 'd' },
+	{"crr",		no_argument,		&crr_mode, 1 },
+	{"no-nodelay",	no_argument,		&nodelay, 0 },
+	{"verbose",	optional_argument,	NULL, 'v' },
+	{"quiet",	no_argument,		&verbose, 0 },
+	{0, 0, NULL,  0 }
+};
+
+static int usage(char *argv[])
+{
+	int i;
+
+	printf("\nDOCUMENTATION:\n%s\n", __doc__);
+	printf(" Usage: %s --server [-p port] [-t threads]\n"
+	       "        %s [options] IP-addr\n\n", argv[0], argv[0]);
+	printf(" Listing options:\n");
+	for (i = 0; long_options[i].name != 0; i++) {
+		printf(" --%-12s", long_options[i].name);
+		if (long_options[i].flag != NULL)
+			printf(" flag (internal value:%d)",
+			       *long_options[i].flag);
+		else
+			printf(" short-option: -%c",
+			       long_options[i].val);
+		printf("\n");
+	}
+	printf("\n");
+	return EXIT_FAIL_OPTION;
+}
+
+static void set_nodelay(int fd)
+{
+	if (nodelay)
+		Setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+			   sizeof(nodelay));
+}
+
+/* Zero filled payload, source of all request/response data */
+static char zero_buf[RR_BUF_SZ];
+
+/* Send pending bytes of a stream of identical messages (msg of size
+ * msg_len), continuing at the offset where the last send stopped.
+ * Returns 0 when done or on EAGAIN (more pending), -1 on error.
+ */
+static int flush_pending(int fd, uint64_t *pending, uint64_t *sent,
+			 const char *msg, uint32_t msg_len)
+{
+	uint32_t off, len;
+	ssize_t res;
+
+	while (*pending) {
+		off = *sent % msg_len;
+		len = msg_len - off;
+		if (len > *pending)
+			len = *pending;
+		res = send(fd, msg + off, len, MSG_NOSIGNAL);
+		if (res < 0)
+			return errno == EAGAIN ? 0 : -1;
+		*pending -= res;
+		*sent += res;
+	}
+	return 0;
+}
+
+static void epoll_mod(int epollfd, int op, int fd, uint32_t events,
+		      uint64_t data)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = data };
+
+	if (epoll_ctl(epollfd, op, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAIL_SOCK);
+	}
+}
+
+/*** Server ***/
+
+struct srv_conn {
+	int fd;
+	uint32_t have;		/* bytes of current request */
+	struct rr_hdr hdr;	/* host byte order, valid when have >= 8 */
+	uint64_t out_pending;	/* response bytes to send */
+	uint64_t out_sent;
+	uint32_t events;
+};
+
+struct srv_thread {
+	pthread_t thread;
+	int id;
+	int listenfd;
+	uint64_t requests;
+	uint64_t conns;
+};
+
+/* Consume received bytes, queue a response per complete request */
+static int srv_parse(struct srv_conn *c, const char *buf, size_t len,
+		     uint64_t *requests)
+{
+	uint32_t n;
+
+	while (len) {
+		if (c->have < sizeof(c->hdr)) {
+			n = sizeof(c->hdr) - c->have;
+			if (n > len)
+				n = len;
+			memcpy((char *)&c->hdr + c->have, buf, n);
+			c->have += n;
+			buf += n;
+			len -= n;
+			if (c->have < sizeof(c->hdr))
+				break;
+			c->hdr.req_len  = ntohl(c->hdr.req_len);
+			c->hdr.resp_len = ntohl(c->hdr.resp_len);
+			if (c->hdr.req_len < sizeof(c->hdr) ||
+			    c->hdr.resp_len > RR_BUF_SZ)
+				return -1; /* protocol error */
+		}
+		n = c->hdr.req_len - c->have;
+		if (n > len)
+			n = len;
+		c->have += n;
+		buf += n;
+		len -= n;
+		if (c->have == c->hdr.req_len) {
+			/* Response size may change per request, send
+			 * from a zero buffer at offset 0.
+			 */
+			c->out_pending += c->hdr.resp_len;
+			c->have = 0;
+			(*requests)++;
+		}
+	}
+	return 0;
+}
+
+static void srv_close(int epollfd, struct srv_conn *c)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c);
+}
+
+static void *srv_thread_run(void *arg)
+{
+	struct srv_thread *t = arg;
+	struct epoll_event events[MAX_EVENTS];
+	static __thread char buf[RR_BUF_SZ];
+	struct srv_conn *c;
+	int epollfd, nfds, n, fd;
+	uint32_t want;
+	ssize_t res;
+
+	pin_to_cpu(t->id % sysconf(_SC_NPROCESSORS_ONLN));
+	epollfd = epoll_create1(0);
+	if (epollfd < 0) {
+		perror("epoll_create");
+		exit(EXIT_FAIL_SOCK);
+	}
+	epoll_mod(epollfd, EPOLL_CTL_ADD, t->listenfd, EPOLLIN, 0);
+
+	while (1) {
+		nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAIL_SOCK);
+		}
+		for (n = 0; n < nfds; n++) {
+			if (!events[n].data.ptr) {
+				/* Listen socket, drain accept queue */
+				while ((fd = accept4(t->listenfd, NULL, NULL,
+						     SOCK_NONBLOCK)) >= 0) {
+					c = calloc(1, sizeof(*c));
+					if (!c)
+						exit(EXIT_FAIL_MEM);
+					c->fd = fd;
+					c->events = EPOLLIN;
+					set_nodelay(fd);
+					epoll_mod(epollfd, EPOLL_CTL_ADD, fd,
+						  c->events, (unsigned long)c);
+					t->conns++;
+				}
+				continue;
+			}
+			c = events[n].data.ptr;
+
+			if (events[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				res = recv(c->fd, buf, sizeof(buf), 0);
+				if (res == 0 ||
+				    (res < 0 && errno != EAGAIN) ||
+				    (res > 0 &&
+				     srv_parse(c, buf, res, &t->requests) < 0)) {
+					srv_close(epollfd, c);
+					continue;
+				}
+			}
+			/* Responses are zero payload, offset unimportant */
+			if (flush_pending(c->fd, &c->out_pending, &c->out_sent,
+					  zero_buf, RR_BUF_SZ) < 0) {
+				srv_close(epollfd, c);
+				continue;
+			}
+			want = c->out_pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+			if (want != c->events) {
+				c->events = want;
+				epoll_mod(epollfd, EPOLL_CTL_MOD, c->fd,
+					  want, (unsigned long)c);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int setup_listener(int addr_family, uint16_t port)
+{
+	struct sockaddr_storage addr;
+	int fd, on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	setup_sockaddr(addr_family, &addr,
+		       addr_family == AF_INET6 ? "::" : "0.0.0.0", port);
+	fd = Socket(addr_family, SOCK_STREAM, IPPROTO_TCP);
+	Setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	Setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	Bind(fd, &addr);
+	/* Notice "backlog" limited by: /proc/sys/net/core/somaxconn */
+	if (listen(fd, 4096) < 0) {
+		perror("listen");
+		exit(EXIT_FAIL_SOCK);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static int run_server(int addr_family, uint16_t port)
+{
+	struct srv_thread *threads;
+	uint64_t requests, prev = 0;
+	int i;
+
+	raise_nofile_limit(65536);
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		exit(EXIT_FAIL_MEM);
+
+	/* SO_REUSEPORT listener per thread */
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].listenfd = setup_listener(addr_family, port);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, srv_thread_run,
+				   &threads[i])) {
+			fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+			exit(EXIT_FAIL_MEM);
+		}
+	}
+	printf("Server listen port:%d threads:%d\n", port, nr_threads);
+
+	while (1) {
+		sleep(1);
+		if (!verbose)
+			continue;
+		for (requests = 0, i = 0; i < nr_threads; i++)
+			requests += threads[i].requests;
+		if (requests != prev)
+			printf("requests/sec: %lu\n", requests - prev);
+		prev = requests;
+	}
+	return 0;
+}
+
+/*** Client ***/
+
+struct cli_conn {
+	int fd;
+	int connecting;		/* CRR: connect in progress */
+	uint64_t conn_start;	/* CRR: RTT includes handshake */
+	uint64_t *sent_ns;	/* FIFO of outstanding request times */
+	unsigned int head, tail;
+	uint32_t rx_have;	/* bytes of current response */
+	uint64_t tx_pending;
+	uint64_t tx_sent;
+	uint32_t events;
+};
+
+struct cli_thread {
+	pthread_t thread;
+	int id;
+	struct sockaddr_storage *dest_addr;
+	char *req_buf;		/* one request, header + zero payload */
+	/* Stats */
+	uint64_t transactions;
+	uint64_t connects;
+	uint64_t errors;
+	struct histogram rtt;
+};
+
+static void cli_queue_req(struct cli_conn *c, uint64_t now)
+{
+	c->sent_ns[c->tail++ % depth] = now;
+	c->tx_pending += req_size;
+}
+
+static int cli_connect(struct cli_thread *t, int epollfd,
+		       struct cli_conn *c)
+{
+	int res;
+
+	c->fd = socket(t->dest_addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+		       IPPROTO_TCP);
+	if (c->fd < 0) {
+		perror("socket");
+		exit(EXIT_FAIL_SOCK);
+	}
+	set_nodelay(c->fd);
+	c->head = c->tail = 0;
+	c->rx_have = 0;
+	c->tx_pending = c->tx_sent = 0;
+	c->conn_start = gettime();
+	res = connect(c->fd, (struct sockaddr *)t->dest_addr,
+		      sockaddr_len(t->dest_addr));
+	if (res < 0 && errno != EINPROGRESS) {
+		t->errors++;
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	c->connecting = 1;
+	c->events = EPOLLOUT;
+	epoll_mod(epollfd, EPOLL_CTL_ADD, c->fd, c->events,
+		  (unsigned long)c);
+	return 0;
+}
+
+/* Connection established, queue the initial requests */
+static void cli_established(struct cli_thread *t, struct cli_conn *c)
+{
+	uint64_t now = gettime();
+	int i;
+
+	c->connecting = 0;
+	t->connects++;
+	if (crr_mode) {
+		/* Request time is connect start, RTT includes 3WHS */
+		cli_queue_req(c, c->conn_start);
+		return;
+	}
+	for (i = 0; i < depth; i++)
+		cli_queue_req(c, now);
+}
+
+static void cli_restart(struct cli_thread *t, int epollfd,
+			struct cli_conn *c)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	while (!stop && cli_connect(t, epollfd, c) < 0)
+		;
+}
+
+/* Response bytes received, complete transactions in FIFO order */
+static int cli_received(struct cli_thread *t, struct cli_conn *c,
+			size_t len)
+{
+	uint64_t now = gettime();
+	int done = 0;
+
+	c->rx_have += len;
+	while (c->rx_have >= resp_size && c->head != c->tail) {
+		c->rx_have -= resp_size;
+		histogram_add(&t->rtt, now - c->sent_ns[c->head++ % depth]);
+		t->transactions++;
+		done++;
+		if (!crr_mode && !stop)
+			cli_queue_req(c, now);
+	}
+	return done;
+}
+
+static void *cli_thread_run(void *arg)
+{
+	struct cli_thread *t = arg;
+	struct epoll_event events[MAX_EVENTS];
+	static __thread char buf[RR_BUF_SZ];
+	struct cli_conn *conns, *c;
+	int epollfd, nfds, n, i, err;
+	socklen_t len;
+	uint32_t want;
+	ssize_t res;
+
+	pin_to_cpu(t->id % sysconf(_SC_NPROCESSORS_ONLN));
+	histogram_init(&t->rtt);
+	epollfd = epoll_create1(0);
+	conns = calloc(nr_conns, sizeof(*conns));
+	if (epollfd < 0 || !conns)
+		exit(EXIT_FAIL_MEM);
+
+	for (i = 0; i < nr_conns; i++) {
+		c = &conns[i];
+		c->sent_ns = calloc(depth, sizeof(uint64_t));
+		if (!c->sent_ns)
+			exit(EXIT_FAIL_MEM);
+		if (cli_connect(t, epollfd, c) < 0) {
+			fprintf(stderr, "ERROR: connect failed: %s\n",
+				strerror(errno));
+			exit(EXIT_FAIL_SOCK);
+		}
+	}
+
+	while (!stop) {
+		nfds = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAIL_SOCK);
+		}
+		for (n = 0; n < nfds; n++) {
+			c = events[n].data.ptr;
+
+			if (c->connecting) {
+				err = 0;
+				len = sizeof(err);
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR,
+					   &err, &len);
+				if (err) {
+					t->errors++;
+					cli_restart(t, epollfd, c);
+					continue;
+				}
+				cli_established(t, c);
+			}
+			if (events[n].events & EPOLLIN) {
+				res = recv(c->fd, buf, sizeof(buf), 0);
+				if (res <= 0 && !(res < 0 && errno == EAGAIN)) {
+					t->errors++; /* server closed */
+					cli_restart(t, epollfd, c);
+					continue;
+				}
+				if (res > 0 && cli_received(t, c, res) &&
+				    crr_mode) {
+					/* One transaction per connection */
+					cli_restart(t, epollfd, c);
+					continue;
+				}
+			}
+			if (flush_pending(c->fd, &c->tx_pending, &c->tx_sent,
+					  t->req_buf, req_size) < 0) {
+				t->errors++;
+				cli_restart(t, epollfd, c);
+				continue;
+			}
+			want = c->tx_pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+			if (want != c->events) {
+				c->events = want;
+				epoll_mod(epollfd, EPOLL_CTL_MOD, c->fd,
+					  want, (unsigned long)c);
+			}
+		}
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+		free(conns[i].sent_ns);
+	}
+	free(conns);
+	close(epollfd);
+	return NULL;
+}
+
+static int run_client(struct sockaddr_storage *dest_addr)
+{
+	uint64_t trans = 0, connects = 0, errors = 0;
+	struct cli_thread *threads;
+	struct histogram rtt;
+	struct rr_hdr *hdr;
+	uint64_t start, now, prev_trans = 0;
+	char *req_buf;
+	double sec;
+	int i, s;
+
+	raise_nofile_limit(nr_threads * nr_conns + 64);
+	req_buf = malloc_payload_buffer(req_size);
+	hdr = (struct rr_hdr *)req_buf;
+	hdr->req_len  = htonl(req_size);
+	hdr->resp_len = htonl(resp_size);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		exit(EXIT_FAIL_MEM);
+	histogram_init(&rtt);
+
+	start = gettime();
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].dest_addr = dest_addr;
+		threads[i].req_buf = req_buf;
+		if (pthread_create(&threads[i].thread, NULL, cli_thread_run,
+				   &threads[i])) {
+			fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+			exit(EXIT_FAIL_MEM);
+		}
+	}
+	for (s = 0; s < duration; s++) {
+		sleep(1);
+		if (!verbose)
+			continue;
+		for (trans = 0, i = 0; i < nr_threads; i++)
+			trans += threads[i].transactions;
+		printf("transactions/sec: %lu\n", trans - prev_trans);
+		prev_trans = trans;
+	}
+	stop = 1;
+	now = gettime();
+
+	trans = 0;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		trans    += threads[i].transactions;
+		connects += threads[i].connects;
+		errors   += threads[i].errors;
+		histogram_merge(&rtt, &threads[i].rtt);
+	}
+	sec = (now - start) / 1e9;
+
+	printf("%s threads:%d conns:%d depth:%d req:%u resp:%u\n",
+	       crr_mode ? "TCP_CRR" : "TCP_RR", nr_threads, nr_conns,
+	       crr_mode ? 1 : depth, req_size, resp_size);
+	printf(" - transactions:%lu in %.3f sec = %.0f trans/sec"
+	       " (connects:%lu errors:%lu)\n", trans, sec, trans / sec,
+	       connects, errors);
+	if (verbose > 1)
+		histogram_print(&rtt, "RTT", "ns");
+	else
+		histogram_print_summary(&rtt, "RTT", "ns");
+
+	free(threads);
+	free(req_buf);
+	return errors && !trans ? EXIT_FAIL_SOCK : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_storage dest_addr;
+	int addr_family = AF_INET;
+	uint16_t port = 6666;
+	int c, longindex = 0;
+
+	memset(&dest_addr, 0, sizeof(dest_addr));
+
+	/* Parse commands line args */
+	while ((c = getopt_long(argc, argv, "hs46p:t:C:D:r:R:d:v::",
+				long_options, &longindex)) != -1) {
+		if (c == 's') server_mode = 1;
+		if (c == '4') addr_family = AF_INET;
+		if (c == '6') addr_family = AF_INET6;
+		if (c == 'p') port        = atoi(optarg);
+		if (c == 't') nr_threads  = atoi(optarg);
+		if (c == 'C') nr_conns    = atoi(optarg);
+		if (c == 'D') depth       = atoi(optarg);
+		if (c == 'r') req_size    = atoi(optarg);
+		if (c == 'R') resp_size   = atoi(optarg);
+		if (c == 'd') duration    = atoi(optarg);
+		if (c == 'v') verbose     = optarg ? atoi(optarg) : 1;
+		if (c == 'h' || c == '?') return usage(argv);
+	}
+	if (nr_threads < 1 || nr_conns < 1 || depth < 1 ||
+	    req_size < sizeof(struct rr_hdr) || !resp_size ||
+	    resp_size > RR_BUF_SZ) {
+		fprintf(stderr, "ERROR: invalid parameters (req size min %zu,"
+			" resp size 1-%d)\n", sizeof(struct rr_hdr),
+			RR_BUF_SZ);
+		return usage(argv);
+	}
+	if (crr_mode)
+		depth = 1;
+
+	if (server_mode)
+		return run_server(addr_family, port);
+
+	if (optind >= argc) {
+		fprintf(stderr, "Expected dest IP-address (IPv6 or IPv4)"
+			" argument after options\n");
+		return usage(argv);
+	}
+	setup_sockaddr(addr_family, &dest_addr, argv[optind], port);
+	return run_client(&dest_addr);
+}
@@ -10,6 +10,10 @@
  * connection, possibly (not-default) write something into the
  * connection, and the close() it quickly.
  *
+ * Listener can enable TCP Fast Open (--fastopen QLEN), where the
+ * request data arrives in the SYN, and TCP_DEFER_ACCEPT
+ * (--defer-accept SEC), where accept() only returns connections with
+ * data.  Use with tcp_sink_client --fastopen/--data.
  */
 
 #define _GNU_SOURCE /* needed for getopt.h */
@@ -37,6 +41,15 @@
 /* Global config setting, default values adjustable via getopt_long */
 static int so_reuseport = 1;
 static int write_something = 0;
+static int fastopen_qlen = 0;
+static int defer_accept = 0;
+
+static const char * const tfo_counters[] = {
+	"TCPFastOpenPassive", "TCPFastOpenPassiveFail",
+	"TCPFastOpenListenOverflow", "TCPFastOpenCookieReqd",
+	"TCPDeferAcceptDrop",
+};
+#define NR_TFO_COUNTERS (sizeof(tfo_counters) / sizeof(tfo_counters[0]))
 
 static const struct option long_options[] = {
 	{"ipv4",	no_argument,		NULL, '4' },
@@ -48,6 +61,8 @@ static const struct option long_options[] = {
 	{"reuseport",	no_argument,		&so_reuseport, 1 },
 	{"no-reuseport",no_argument,		&so_reuseport, 0 },
 	{"write-back",	no_argument,		&write_something, 1 },
+	{"fastopen",	required_argument,	NULL, 'F' },
+	{"defer-accept",required_argument,	NULL, 'D' },
 	{0, 0, NULL,  0 }
 };
 
@@ -81,12 +96,14 @@ int main(int argc, char *argv[])
 	int c, i;
 	int count  = 1000000;
 	pid_t pid = getpid();
+	long long tfo_vals[NR_TFO_COUNTERS];
 
 	/* Default settings */
 	int addr_family = AF_INET; /* Default address family */
 	uint16_t listen_port = 6666;
 
 	char send_buf[1024];
+	char req_buf[2048];
 
 	/* Support for both IPv4 and IPv6.
 	 *  sockaddr_storage: Can contain both sockaddr_in and sockaddr_in6
@@ -97,7 +114,7 @@ int main(int argc, char *argv[])
 	memset(send_buf, 0, sizeof(send_buf));
 
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "c:l:64swv:",
+	while ((c = getopt_long(argc, argv, "c:l:64swv:F:D:",
 			long_options, &longindex)) != -1) {
 		if (c == 0) { /* optional handling "flag" options */
 			if (verbose) {
@@ -112,6 +129,8 @@ int main(int argc, char *argv[])
 		if (c == '4') addr_family = AF_INET;
 		if (c == '6') addr_family = AF_INET6;
 		if (c == 'w') write_something = 1;
+		if (c == 'F') fastopen_qlen   = atoi(optarg);
+		if (c == 'D') defer_accept    = atoi(optarg);
 		if (c == 'v') (optarg) ? verbose = atoi(optarg) : (verbose = 1);
 		if (c == '?') return usage(argv);
 	}
@@ -151,6 +170,21 @@ int main(int argc, char *argv[])
 
 	Bind(listenfd, &listen_addr);
 
+	/* Max queue of TFO requests, not yet completed 3WHS */
+	if (fastopen_qlen)
+		Setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+			   &fastopen_qlen, sizeof(fastopen_qlen));
+	/* Only wakeup accept() when data arrived, or timeout sec */
+	if (defer_accept)
+		Setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			   &defer_accept, sizeof(defer_accept));
+	/* Server side TFO must be enabled by sysctl bit 0x2 */
+	if (fastopen_qlen &&
+	    !(read_proc_int(PROC_TCP_FASTOPEN) & TFO_SERVER_ENABLE))
+		fprintf(stderr, "WARN: TFO server disabled, set sysctl"
+			" net.ipv4.tcp_fastopen=3\n");
+	tcpext_snapshot(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
+
 	/* Notice "backlog" limited by: /proc/sys/net/core/somaxconn */
 	listen(listenfd, 1024);
 
@@ -166,6 +200,13 @@ int main(int argc, char *argv[])
 		 */
 		connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
 
+		/* With TFO or TCP_DEFER_ACCEPT the request is already
+		 * queued, consume it as close() with unread data sends
+		 * a RST instead of FIN.
+		 */
+		if (fastopen_qlen || defer_accept)
+			recv(connfd, req_buf, sizeof(req_buf), MSG_DONTWAIT);
+
 		if (write_something) {
 			/* Send/write something back into the TCP stream */
 			snprintf(send_buf, sizeof(send_buf),
@@ -179,6 +220,9 @@ int main(int argc, char *argv[])
 
 	}
 
+	if (fastopen_qlen || defer_accept)
+		tcpext_print_delta(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
+
 	close(listenfd);
 	return 0;
 }
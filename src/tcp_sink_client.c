@@ -4,6 +4,23 @@
  * From: https://github.com/netoptimizer/network-testing
  *
  * TCP client program for tcp_sink.c
+ *
+ * Default does socket, connect and close serially.  The --async mode
+ * is an epoll driven non-blocking connect generator, keeping
+ * --inflight connections in progress per thread, for saturating the
+ * (SO_REUSEPORT) tcp_sink servers.
+ *
+ * With --data N each connection sends N bytes after connect, and
+ * --fastopen carries them in the SYN (TCP Fast Open).  Compare against
+ * tcp_sink_epoll --fastopen QLEN and --defer-accept SEC.
+ *
+ * The --churn mode is a TIME_WAIT and ephemeral port pressure
+ * simulator.  It opens and closes connections at a fixed --rate for
+ * --duration seconds per close/bind strategy, sampling the number of
+ * TIME_WAIT sockets (via sock_diag netlink) and counting EADDRNOTAVAIL
+ * retries.  Strategies run back-to-back, so TIME_WAIT left by one
+ * strategy is seen by the next one; start with the strategy of
+ * interest or wait for tcp_fin_timeout in between runs.
  */
 
 #define _GNU_SOURCE /* needed for getopt.h */
@@ -18,6 +35,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 
 #include "global.h"
 #include "common.h"
@@ -28,6 +51,42 @@
  */
 static int close_conn = 1;
 
+/* Async connect generator settings */
+static int async_mode = 0;
+static int inflight = 64;
+static int nr_threads = 1;
+static struct sockaddr_storage *src_addrs; /* rotated source IPs */
+static int nr_src_addrs;
+static uint16_t sport_lo, sport_hi;	/* rotated source ports */
+static int latency_mode = 0;	/* send stamp, read TCP_INFO */
+
+/* Request data, send in SYN with --fastopen */
+static int fastopen = 0;
+static int data_len = 0;
+static char *payload;
+
+/* Churn mode: close/bind strategies */
+enum churn_strategy {
+	CHURN_CLOSE = 0,	/* normal close, port chosen at connect */
+	CHURN_LINGER0,		/* SO_LINGER 0, RST instead of TIME_WAIT */
+	CHURN_NO_PORT,		/* bind() --src-ip, IP_BIND_ADDRESS_NO_PORT */
+	CHURN_REUSEADDR,	/* bind() src IP port 0 with SO_REUSEADDR */
+	CHURN_MAX,
+};
+static const char *churn_names[CHURN_MAX] = {
+	"close", "linger0", "no-port", "reuseaddr"
+};
+static int churn_rate = 10000;		/* target conn/sec */
+static int churn_duration = 10;	/* sec per strategy */
+
+#define TCP_STATE_TIME_WAIT	6 /* include/net/tcp_states.h */
+#define CHURN_MAX_RETRIES	100
+
+static const char * const tfo_counters[] = {
+	"TCPFastOpenActive", "TCPFastOpenActiveFail",
+};
+#define NR_TFO_COUNTERS (sizeof(tfo_counters) / sizeof(tfo_counters[0]))
+
 static struct option long_options[] = {
 	{"ipv4",	no_argument,		NULL, '4' },
 	{"ipv6",	no_argument,		NULL, '6' },
@@ -37,6 +96,18 @@ static struct option long_options[] = {
 	{"verbose",	optional_argument,	NULL, 'v' },
 	{"quiet",	no_argument,		&verbose, 0 },
 	{"no-close",	no_argument,		&close_conn, 0 },
+	{"count",	required_argument,	NULL, 'c' },
+	{"async",	no_argument,		NULL, 'a' },
+	{"inflight",	required_argument,	NULL, 'n' },
+	{"threads",	required_argument,	NULL, 't' },
+	{"src-ip",	required_argument,	NULL, 'S' },
+	{"sport-range",	required_argument,	NULL, 'R' },
+	{"latency",	no_argument,		&latency_mode, 1 },
+	{"fastopen",	no_argument,		&fastopen, 1 },
+	{"data",	required_argument,	NULL, 'd' },
+	{"churn",	required_argument,	NULL, 'C' },
+	{"rate",	required_argument,	NULL, 'r' },
+	{"duration",	required_argument,	NULL, 'D' },
 	{0, 0, NULL,  0 }
 };
 
@@ -45,6 +116,28 @@ static int usage(char *argv[])
 	printf("-= ERROR: Parameter problems =-\n");
 	printf(" Usage: %s [-c count] [-p port] [-4] [-6] [-v] IP-addr\n\n",
 	       argv[0]);
+	printf(" Async connect generator:\n"
+	       "  --async            : epoll non-blocking connects\n"
+	       "  --inflight N       : connects in progress per thread (%d)\n"
+	       "  --threads N        : generator threads (%d)\n"
+	       "  --src-ip IP[,IP]   : rotate over source IPs\n"
+	       "  --sport-range LO-HI: rotate over source ports\n"
+	       "  --latency          : send connect time stamp to\n"
+	       "                       tcp_sink_epoll --latency, and\n"
+	       "                       read TCP_INFO before close\n\n",
+	       inflight, nr_threads);
+	printf(" Connection setup:\n"
+	       "  --data N           : send N bytes request after connect\n"
+	       "  --fastopen         : send request data in SYN (TFO),\n"
+	       "                       needs --data N\n\n");
+	printf(" TIME_WAIT/port pressure (--churn):\n"
+	       "  --churn LIST       : strategies close,linger0,no-port,"
+	       "reuseaddr\n"
+	       "                       (no-port needs --src-ip, the first\n"
+	       "                       IP is bound by no-port/reuseaddr)\n"
+	       "  --rate N           : target connections/sec (%d)\n"
+	       "  --duration SEC     : run time per strategy (%d)\n\n",
+	       churn_rate, churn_duration);
 	return EXIT_FAIL_OPTION;
 }
 
@@ -122,8 +215,577 @@ retry:
 	return res;
 }
 
+/* Per thread state of async connect generator */
+struct conn_slot {
+	int fd;
+	int sent;	/* request data already in SYN */
+	uint64_t start_ns;
+};
+
+struct conn_thread {
+	pthread_t thread;
+	int id;
+	int addr_family;
+	struct sockaddr_storage *dest_addr;
+	int count;	/* connect attempts for this thread */
+	int started;
+	uint32_t tuple;	/* source IP/port rotation index */
+	/* Stats */
+	uint64_t connects;
+	uint64_t errors;
+	uint64_t addr_notavail;
+	uint64_t bind_errors;
+	int last_errno;
+	struct histogram lat;
+	struct histogram rtt;	/* --latency: TCP_INFO tcpi_rtt */
+	uint64_t retrans;
+};
+
+/* Select next source IP and port.  Each thread rotates over all
+ * source IPs, then steps to its next source port in the range
+ * (ports are interleaved between threads), maximizing the time
+ * before a 4-tuple is reused (and might hit TIME_WAIT).
+ */
+static int bind_next_tuple(struct conn_thread *t, int fd)
+{
+	struct sockaddr_storage addr;
+	uint32_t k, range;
+	int val = 1;
+
+	if (!nr_src_addrs && !sport_lo)
+		return 0;
+
+	if (nr_src_addrs) {
+		addr = src_addrs[t->tuple % nr_src_addrs];
+		k = t->tuple / nr_src_addrs;
+	} else {
+		setup_sockaddr(t->addr_family, &addr,
+			       t->addr_family == AF_INET6 ? "::" : "0.0.0.0",
+			       0);
+		k = t->tuple;
+	}
+	t->tuple++;
+
+	if (sport_lo) {
+		range = sport_hi - sport_lo + 1;
+		sockaddr_set_port(&addr, sport_lo +
+				  (t->id + (uint64_t)k * nr_threads) % range);
+		/* Allow re-bind of port, still in TIME_WAIT */
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	} else {
+		/* Source IP only, port selected at connect() time,
+		 * unique per 4-tuple instead of per source IP.
+		 */
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+			   &val, sizeof(val));
+	}
+	return bind(fd, (struct sockaddr *)&addr, sockaddr_len(&addr));
+}
+
+/* Stamp lets the server calculate its accept-queue delay */
+static void conn_latency(struct conn_thread *t, int fd, uint64_t now)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	send(fd, &now, sizeof(now), MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (!getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+		histogram_add(&t->rtt, info.tcpi_rtt * 1000ULL);
+		t->retrans += info.tcpi_total_retrans;
+	}
+}
+
+static void conn_done(struct conn_thread *t, struct conn_slot *slot,
+		      int err, uint64_t now)
+{
+	if (!err) {
+		t->connects++;
+		histogram_add(&t->lat, now - slot->start_ns);
+		if (data_len && !slot->sent)
+			send(slot->fd, payload, data_len,
+			     MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (latency_mode)
+			conn_latency(t, slot->fd, now);
+	} else {
+		t->errors++;
+		t->last_errno = err;
+		if (err == EADDRNOTAVAIL)
+			t->addr_notavail++;
+	}
+	if (close_conn || err)
+		close(slot->fd);
+	slot->fd = -1;
+}
+
+/* Start next non-blocking connect in slot, returns 1 if connect is
+ * in progress, 0 when thread has no more connections to start.
+ */
+static int conn_start(struct conn_thread *t, int epollfd,
+		      struct conn_slot *slot, int idx)
+{
+	struct epoll_event ev;
+	int fd, res;
+
+	while (t->started < t->count) {
+		t->started++;
+		fd = socket(t->addr_family, SOCK_STREAM | SOCK_NONBLOCK,
+			    IPPROTO_TCP);
+		if (fd < 0) {
+			fprintf(stderr, "ERROR: socket() failed errno(%d) ",
+				errno);
+			perror("- socket");
+			exit(EXIT_FAIL_SOCK);
+		}
+		slot->fd = fd;
+		slot->sent = 0;
+		if (fastopen)
+			setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+				   &fastopen, sizeof(fastopen));
+		if (bind_next_tuple(t, fd) < 0) {
+			t->bind_errors++;
+			conn_done(t, slot, errno, 0);
+			continue;
+		}
+		slot->start_ns = gettime();
+		res = connect(fd, (struct sockaddr *)t->dest_addr,
+			      sockaddr_len(t->dest_addr));
+		if (res == 0 && fastopen) {
+			/* TFO cookie known: connect() deferred, SYN is
+			 * sent by first write carrying the request data.
+			 * Without cookie, this is a normal EINPROGRESS.
+			 */
+			if (send(fd, payload, data_len, MSG_NOSIGNAL) > 0)
+				slot->sent = 1;
+			res = -1;
+			errno = EINPROGRESS;
+		}
+		if (res == 0) {
+			conn_done(t, slot, 0, gettime());
+			continue;
+		}
+		if (errno != EINPROGRESS) {
+			conn_done(t, slot, errno, 0);
+			continue;
+		}
+		ev.events = EPOLLOUT;
+		ev.data.u32 = idx;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			exit(EXIT_FAIL_SOCK);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static void *conn_thread_run(void *arg)
+{
+	struct conn_thread *t = arg;
+	struct epoll_event events[256];
+	struct conn_slot *slots, *slot;
+	int epollfd, active = 0;
+	int i, n, nfds, err;
+	socklen_t len;
+	uint64_t now;
+
+	slots = calloc(inflight, sizeof(*slots));
+	epollfd = epoll_create1(0);
+	if (!slots || epollfd < 0) {
+		fprintf(stderr, "ERROR: thread %d setup failed\n", t->id);
+		exit(EXIT_FAIL_MEM);
+	}
+	histogram_init(&t->lat);
+	histogram_init(&t->rtt);
+
+	for (i = 0; i < inflight; i++)
+		active += conn_start(t, epollfd, &slots[i], i);
+
+	while (active > 0) {
+		nfds = epoll_wait(epollfd, events, 256, 1000);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAIL_SOCK);
+		}
+		now = gettime();
+		for (n = 0; n < nfds; n++) {
+			i = events[n].data.u32;
+			slot = &slots[i];
+
+			/* Connect completed, or failed */
+			err = 0;
+			len = sizeof(err);
+			getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (!close_conn || err)
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, slot->fd, NULL);
+			conn_done(t, slot, err, now);
+			active--;
+			active += conn_start(t, epollfd, slot, i);
+		}
+	}
+	close(epollfd);
+	free(slots);
+	return NULL;
+}
+
+static int run_async(int addr_family, struct sockaddr_storage *dest_addr,
+		     int count)
+{
+	uint64_t connects = 0, errors = 0, notavail = 0, bind_err = 0;
+	uint64_t retrans = 0;
+	long long tfo_vals[NR_TFO_COUNTERS];
+	struct conn_thread *threads;
+	struct histogram lat, rtt;
+	uint64_t start, stop;
+	double sec;
+	int i;
+
+	/* Connections are kept open with --no-close */
+	raise_nofile_limit(close_conn ? inflight * nr_threads + 64
+				      : count + 64);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "ERROR: cannot alloc %d threads\n",
+			nr_threads);
+		exit(EXIT_FAIL_MEM);
+	}
+	histogram_init(&lat);
+	histogram_init(&rtt);
+	tcpext_snapshot(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
+
+	start = gettime();
+	for (i = 0; i < nr_threads; i++) {
+		struct conn_thread *t = &threads[i];
+
+		t->id = i;
+		t->addr_family = addr_family;
+		t->dest_addr = dest_addr;
+		t->count = count / nr_threads + (i < count % nr_threads);
+		if (pthread_create(&t->thread, NULL, conn_thread_run, t)) {
+			fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+			exit(EXIT_FAIL_MEM);
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		struct conn_thread *t = &threads[i];
+
+		pthread_join(t->thread, NULL);
+		connects += t->connects;
+		errors   += t->errors;
+		notavail += t->addr_notavail;
+		bind_err += t->bind_errors;
+		histogram_merge(&lat, &t->lat);
+		histogram_merge(&rtt, &t->rtt);
+		retrans  += t->retrans;
+		if (verbose && nr_threads > 1)
+			printf(" thread %d: connects:%lu errors:%lu\n",
+			       i, t->connects, t->errors);
+		if (t->errors)
+			fprintf(stderr, "WARN: thread %d last error: %s\n",
+				i, strerror(t->last_errno));
+	}
+	stop = gettime();
+	sec = (stop - start) / 1e9;
+
+	printf("Async connect threads:%d inflight:%d src-ips:%d"
+	       " sport-range:%u-%u\n", nr_threads, inflight, nr_src_addrs,
+	       sport_lo, sport_hi);
+	printf(" - connects:%lu errors:%lu (EADDRNOTAVAIL:%lu bind:%lu)"
+	       " in %.3f sec\n", connects, errors, notavail, bind_err, sec);
+	printf(" - connects/sec: %.0f\n", connects / sec);
+	if (verbose)
+		histogram_print(&lat, "handshake latency", "ns");
+	else
+		histogram_print_summary(&lat, "handshake latency", "ns");
+	if (latency_mode) {
+		histogram_print_summary(&rtt, "TCP_INFO rtt", "ns");
+		printf(" - retransmits:%lu\n", retrans);
+	}
+	if (fastopen)
+		tcpext_print_delta(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
+
+	free(threads);
+	return errors ? EXIT_FAIL_SOCK : 0;
+}
+
+/* Count TIME_WAIT sockets towards dport, via NETLINK_SOCK_DIAG dump.
+ * Cheaper and more exact than parsing /proc/net/tcp under load.
+ */
+static int time_wait_count(int nlfd, int addr_family, uint16_t dport)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg;
+	static char buf[65536];
+	struct inet_diag_msg *diag;
+	struct nlmsghdr *nlh;
+	int len, count = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len   = sizeof(msg);
+	msg.nlh.nlmsg_type  = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.req.sdiag_family   = addr_family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states   = 1 << TCP_STATE_TIME_WAIT;
+
+	if (send(nlfd, &msg, sizeof(msg), 0) < 0)
+		return -1;
+
+	while ((len = recv(nlfd, buf, sizeof(buf), 0)) > 0) {
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return count;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			diag = NLMSG_DATA(nlh);
+			if (ntohs(diag->id.idiag_dport) == dport)
+				count++;
+		}
+	}
+	return -1;
+}
+
+static int parse_churn_strategies(char *list, int *strategies)
+{
+	char *tok, *save = NULL;
+	int i, nr = 0;
+
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < CHURN_MAX; i++)
+			if (!strcmp(tok, churn_names[i]))
+				break;
+		if (i == CHURN_MAX || nr == CHURN_MAX) {
+			fprintf(stderr, "ERROR: unknown churn strategy %s\n",
+				tok);
+			return 0;
+		}
+		strategies[nr++] = i;
+	}
+	return nr;
+}
+
+struct churn_stats {
+	uint64_t connects;
+	uint64_t notavail;	/* EADDRNOTAVAIL retries, connect() */
+	uint64_t inuse;		/* EADDRINUSE retries, bind() */
+	uint64_t failed;	/* gave up after retries, or other errors */
+	uint64_t late;		/* behind target rate schedule */
+	int tw_start;
+	int tw_max;
+	int tw_end;
+	struct histogram lat;
+};
+
+/* One paced connection, returns 0 on success or errno */
+static int churn_connect(int strategy, int addr_family,
+			 struct sockaddr_storage *dest_addr,
+			 struct churn_stats *st)
+{
+	struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+	struct sockaddr_storage src;
+	int fd, res, val = 1;
+	int retries = 0;
+	uint64_t start;
+
+retry:
+	fd = Socket(addr_family, SOCK_STREAM, IPPROTO_TCP);
+	start = gettime();
+
+	if (strategy == CHURN_NO_PORT || strategy == CHURN_REUSEADDR) {
+		/* Bind a real source IP, a wildcard bind with NO_PORT
+		 * is the same as no bind(), thus the close strategy.
+		 */
+		if (nr_src_addrs)
+			src = src_addrs[0];
+		else
+			setup_sockaddr(addr_family, &src, addr_family ==
+				       AF_INET6 ? "::" : "0.0.0.0", 0);
+		if (strategy == CHURN_NO_PORT)
+			Setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+				   &val, sizeof(val));
+		else
+			Setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				   &val, sizeof(val));
+		/* Without NO_PORT the port is allocated here, and a
+		 * bind() can fail with EADDRINUSE when exhausted.
+		 */
+		if (bind(fd, (struct sockaddr *)&src, sockaddr_len(&src)) < 0)
+			goto err;
+	}
+
+	res = connect(fd, (struct sockaddr *)dest_addr,
+		      sockaddr_len(dest_addr));
+	if (res < 0)
+		goto err;
+	histogram_add(&st->lat, gettime() - start);
+	st->connects++;
+
+	if (strategy == CHURN_LINGER0)
+		Setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	close(fd);
+	return 0;
+
+err:
+	res = errno;
+	close(fd);
+	if ((res == EADDRNOTAVAIL || res == EADDRINUSE) &&
+	    retries++ < CHURN_MAX_RETRIES) {
+		if (res == EADDRNOTAVAIL)
+			st->notavail++;
+		else
+			st->inuse++;
+		goto retry;
+	}
+	st->failed++;
+	return res;
+}
+
+static void churn_run(int strategy, int addr_family,
+		      struct sockaddr_storage *dest_addr, uint16_t dest_port,
+		      int nlfd, struct churn_stats *st)
+{
+	uint64_t start, next_sample, now, i = 0;
+	uint64_t interval = 1000000000ULL / churn_rate;
+	uint64_t last_connects = 0, last_notavail = 0, last_inuse = 0;
+	struct timespec ts;
+	int last_err = 0;
+	int err, tw;
+
+	memset(st, 0, sizeof(*st));
+	histogram_init(&st->lat);
+	st->tw_start = st->tw_max = time_wait_count(nlfd, addr_family,
+						    dest_port);
+
+	start = gettime();
+	next_sample = start + 1000000000ULL;
+	while ((now = gettime()) - start < churn_duration * 1000000000ULL) {
+		uint64_t deadline = start + i * interval;
+
+		/* Pace to target rate, absolute deadlines avoid drift */
+		if (now < deadline) {
+			ts.tv_sec  = deadline / 1000000000ULL;
+			ts.tv_nsec = deadline % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL);
+		} else if (now - deadline > interval) {
+			st->late++;
+		}
+		i++;
+
+		err = churn_connect(strategy, addr_family, dest_addr, st);
+		if (err)
+			last_err = err;
+
+		if (gettime() >= next_sample) {
+			tw = time_wait_count(nlfd, addr_family, dest_port);
+			if (tw > st->tw_max)
+				st->tw_max = tw;
+			if (verbose)
+				printf(" %-10s conn/s:%lu EADDRNOTAVAIL/s:%lu"
+				       " EADDRINUSE/s:%lu failed:%lu"
+				       " TIME_WAIT:%d\n",
+				       churn_names[strategy],
+				       st->connects - last_connects,
+				       st->notavail - last_notavail,
+				       st->inuse - last_inuse,
+				       st->failed, tw);
+			last_connects = st->connects;
+			last_notavail = st->notavail;
+			last_inuse = st->inuse;
+			next_sample += 1000000000ULL;
+		}
+	}
+	st->tw_end = time_wait_count(nlfd, addr_family, dest_port);
+	if (st->tw_end > st->tw_max)
+		st->tw_max = st->tw_end;
+	if (last_err)
+		fprintf(stderr, "WARN: %s last error: %s\n",
+			churn_names[strategy], strerror(last_err));
+}
+
+static int run_churn(int addr_family, struct sockaddr_storage *dest_addr,
+		     uint16_t dest_port, char *list)
+{
+	int strategies[CHURN_MAX];
+	struct churn_stats st;
+	int port_lo = 0, port_hi = 0;
+	int i, nr, nlfd, failed = 0;
+	FILE *f;
+
+	nr = parse_churn_strategies(list, strategies);
+	if (!nr || churn_rate < 1 || churn_duration < 1)
+		return EXIT_FAIL_OPTION;
+	for (i = 0; i < nr; i++) {
+		if (strategies[i] == CHURN_NO_PORT && !nr_src_addrs) {
+			fprintf(stderr, "ERROR: --churn no-port needs"
+				" --src-ip\n");
+			return EXIT_FAIL_OPTION;
+		}
+	}
+
+	nlfd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG);
+	if (nlfd < 0) {
+		perror("ERROR: socket(NETLINK_SOCK_DIAG)");
+		return EXIT_FAIL_SOCK;
+	}
+
+	f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+	if (f) {
+		if (fscanf(f, "%d %d", &port_lo, &port_hi) != 2)
+			port_lo = port_hi = 0;
+		fclose(f);
+	}
+	printf("Churn rate:%d conn/s duration:%d sec ports:%d-%d"
+	       " tcp_tw_reuse:%d tcp_fin_timeout:%d\n",
+	       churn_rate, churn_duration, port_lo, port_hi,
+	       read_proc_int("/proc/sys/net/ipv4/tcp_tw_reuse"),
+	       read_proc_int("/proc/sys/net/ipv4/tcp_fin_timeout"));
+
+	for (i = 0; i < nr; i++) {
+		churn_run(strategies[i], addr_family, dest_addr, dest_port,
+			  nlfd, &st);
+		failed += st.failed > 0;
+		printf("%-10s conns:%lu conn/s:%.0f EADDRNOTAVAIL:%lu"
+		       " EADDRINUSE:%lu failed:%lu late:%lu"
+		       " TIME_WAIT start:%d max:%d end:%d\n",
+		       churn_names[strategies[i]], st.connects,
+		       (double)st.connects / churn_duration, st.notavail,
+		       st.inuse, st.failed, st.late,
+		       st.tw_start, st.tw_max, st.tw_end);
+		histogram_print_summary(&st.lat, "bind+connect latency",
+					"ns");
+	}
+	close(nlfd);
+	return failed ? EXIT_FAIL_SOCK : 0;
+}
+
+/* Parse --src-ip comma list, after address family is known */
+static void setup_src_addrs(int addr_family, char *list)
+{
+	char *tok, *save = NULL;
+	int max = 1;
+	char *p;
+
+	for (p = list; *p; p++)
+		if (*p == ',')
+			max++;
+	src_addrs = calloc(max, sizeof(*src_addrs));
+	if (!src_addrs)
+		exit(EXIT_FAIL_MEM);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save))
+		setup_sockaddr(addr_family, &src_addrs[nr_src_addrs++], tok, 0);
+}
+
 int main(int argc, char *argv[])
 {
+	long long tfo_vals[NR_TFO_COUNTERS];
 	int sockfd;
 	int i, c, longindex = 0;
 	char *dest_ip;
@@ -133,6 +795,8 @@ int main(int argc, char *argv[])
 	uint16_t dest_port = 6666;
 	uint16_t src_port = 0; /* Allow to "force" source port */
 	int count = 100;
+	char *src_ips = NULL;
+	char *churn = NULL;
 
 	/* Support for both IPv4 and IPv6.
 	 *  sockaddr_storage: Can contain both sockaddr_in and sockaddr_in6
@@ -141,7 +805,7 @@ int main(int argc, char *argv[])
 	memset(&dest_addr, 0, sizeof(dest_addr));
 
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "c:p:s:64v:",
+	while ((c = getopt_long(argc, argv, "c:p:s:64v:an:t:S:R:d:C:r:D:",
 			long_options, &longindex)) != -1) {
 		if (c == 0) { /* optional handling "flag" options */
 			if (verbose) {
@@ -157,6 +821,23 @@ int main(int argc, char *argv[])
 		if (c == '4') addr_family = AF_INET;
 		if (c == '6') addr_family = AF_INET6;
 		if (c == 'v') (optarg) ? verbose = atoi(optarg) : (verbose = 1);
+		if (c == 'a') async_mode  = 1;
+		if (c == 'n') inflight    = atoi(optarg);
+		if (c == 't') nr_threads  = atoi(optarg);
+		if (c == 'S') src_ips     = optarg;
+		if (c == 'd') data_len    = atoi(optarg);
+		if (c == 'C') churn       = optarg;
+		if (c == 'r') churn_rate  = atoi(optarg);
+		if (c == 'D') churn_duration = atoi(optarg);
+		if (c == 'R') {
+			unsigned int lo, hi;
+
+			if (sscanf(optarg, "%u-%u", &lo, &hi) != 2 ||
+			    !lo || lo > hi || hi > 65535)
+				return usage(argv);
+			sport_lo = lo;
+			sport_hi = hi;
+		}
 		if (c == '?') return usage(argv);
 	}
 	if (optind >= argc) {
@@ -173,6 +854,42 @@ int main(int argc, char *argv[])
 	/*** Socket setup ***/
 	setup_sockaddr(addr_family, &dest_addr, dest_ip , dest_port);
 
+	/* Server reads the stamp from the first bytes of the stream */
+	if (latency_mode && data_len) {
+		fprintf(stderr, "ERROR: --latency cannot be combined with"
+			" --data or --fastopen\n");
+		return usage(argv);
+	}
+	if (data_len < 0 || (fastopen && !data_len)) {
+		fprintf(stderr, "ERROR: --fastopen needs --data N\n");
+		return usage(argv);
+	}
+	if (data_len)
+		payload = malloc_payload_buffer(data_len);
+	/* Client side TFO must be enabled by sysctl bit 0x1 */
+	if (fastopen &&
+	    !(read_proc_int(PROC_TCP_FASTOPEN) & TFO_CLIENT_ENABLE))
+		fprintf(stderr, "WARN: TFO client disabled, set sysctl"
+			" net.ipv4.tcp_fastopen=3\n");
+
+	if (churn) {
+		if (src_ips)
+			setup_src_addrs(addr_family, src_ips);
+		i = run_churn(addr_family, &dest_addr, dest_port, churn);
+		return (i == EXIT_FAIL_OPTION) ? usage(argv) : i;
+	}
+
+	if (async_mode) {
+		if (inflight < 1 || nr_threads < 1)
+			return usage(argv);
+		if (src_port > 0 && !sport_lo)
+			sport_lo = sport_hi = src_port;
+		if (src_ips)
+			setup_src_addrs(addr_family, src_ips);
+		return run_async(addr_family, &dest_addr, count);
+	}
+
+	tcpext_snapshot(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
 	for (i = 0; i < count; i++) {
 		if (verbose)
 			printf("count:%d\n", i);
@@ -181,11 +898,27 @@ int main(int argc, char *argv[])
 		if (src_port > 0)
 			bind_source_port(addr_family, sockfd, src_port);
 
-		connect_retries(sockfd, &dest_addr, 2);
+		if (fastopen) {
+			/* Implicit connect, data in SYN if cookie known */
+			if (sendto(sockfd, payload, data_len, MSG_FASTOPEN,
+				   (struct sockaddr *)&dest_addr,
+				   sockaddr_len(&dest_addr)) < 0) {
+				fprintf(stderr, "ERROR: sendto(MSG_FASTOPEN)"
+					" failed errno(%d) ", errno);
+				perror("- sendto");
+				exit(EXIT_FAIL_SOCK);
+			}
+		} else {
+			connect_retries(sockfd, &dest_addr, 2);
+			if (data_len)
+				send(sockfd, payload, data_len, MSG_NOSIGNAL);
+		}
 
 		if (close_conn)
 			Close(sockfd);
 	}
+	if (fastopen)
+		tcpext_print_delta(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
 
 	return 0;
 }
@@ -10,6 +10,28 @@
  * connection, possibly (not-default) write something into the
  * connection, and the close() it quickly.
  *
+ * With --threads N, each thread gets its own SO_REUSEPORT listener
+ * and epoll instance, pinned to a CPU, for measuring how the accept
+ * rate scales across cores.
+ *
+ * With --io-uring, connections are accepted by a single multishot
+ * accept request, and the optional write-back and close are linked
+ * requests, avoiding any per-connection syscalls.
+ *
+ * With --threads and --latency, each accepted connection is
+ * inspected with TCP_INFO, and the accept-queue delay is measured
+ * against the connect completion time stamp sent by
+ * tcp_sink_client --async --latency (same host/clock needed).
+ *
+ * The --steer option selects how the kernel spreads connections over
+ * the SO_REUSEPORT group of --threads listeners: the default hash, a
+ * classic BPF program selecting by CPU, or an eBPF SK_REUSEPORT
+ * program selecting from a sockarray map by hash or CPU.
+ *
+ * Listeners can enable TCP Fast Open (--fastopen QLEN), where the
+ * request data arrives in the SYN, and TCP_DEFER_ACCEPT
+ * (--defer-accept SEC), where accept() only returns connections with
+ * data.  Use with tcp_sink_client --fastopen/--data.
  */
 
 #define _GNU_SOURCE /* needed for getopt.h */
@@ -25,12 +47,21 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <getopt.h>
 
 #include <linux/unistd.h>
 
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <math.h>
 
 #include "global.h"
 #include "common.h"
@@ -40,6 +71,40 @@
 static int so_reuseport = 1;
 static int write_something = 0;
 static int use_epoll = 0;
+static int nr_threads = 0;
+static int use_uring = 0;
+static int uring_direct = 0;
+static int latency_mode = 0;
+
+/* SO_REUSEPORT group steering, with --threads */
+enum steer_mode {
+	STEER_HASH = 0,	/* kernel default, hash of 4-tuple */
+	STEER_CBPF,	/* classic BPF, by CPU */
+	STEER_EBPF_HASH,/* eBPF sockarray, by hash */
+	STEER_EBPF_CPU,	/* eBPF sockarray, by CPU */
+};
+static const char *steer_names[] = {
+	[STEER_HASH]	  = "hash",
+	[STEER_CBPF]	  = "cbpf",
+	[STEER_EBPF_HASH] = "ebpf-hash",
+	[STEER_EBPF_CPU]  = "ebpf-cpu",
+};
+static int steer_mode = STEER_HASH;
+
+/* Connection setup modes */
+static int fastopen_qlen = 0;
+static int defer_accept = 0;
+
+static const char * const tfo_counters[] = {
+	"TCPFastOpenPassive", "TCPFastOpenPassiveFail",
+	"TCPFastOpenListenOverflow", "TCPFastOpenCookieReqd",
+	"TCPDeferAcceptDrop",
+};
+#define NR_TFO_COUNTERS (sizeof(tfo_counters) / sizeof(tfo_counters[0]))
+
+/* Accept rate of single listener modes (also used by threads) */
+static uint64_t start_ns;	/* first accept */
+static uint64_t stop_ns;
 
 static struct option long_options[] = {
 	{"ipv4",	no_argument,		NULL, '4' },
@@ -52,6 +117,13 @@ static struct option long_options[] = {
 	{"no-reuseport",no_argument,		&so_reuseport, 0 },
 	{"write-back", 	no_argument,		&write_something, 1 },
 	{"epoll", 	no_argument,		&use_epoll, 1 },
+	{"threads",	required_argument,	NULL, 't' },
+	{"io-uring",	no_argument,		&use_uring, 1 },
+	{"direct",	no_argument,		&uring_direct, 1 },
+	{"latency",	no_argument,		&latency_mode, 1 },
+	{"steer",	required_argument,	NULL, 'S' },
+	{"fastopen",	required_argument,	NULL, 'F' },
+	{"defer-accept",required_argument,	NULL, 'D' },
 	{0, 0, NULL,  0 }
 };
 
@@ -78,6 +150,18 @@ static int usage(char *argv[])
 	return EXIT_FAIL_OPTION;
 }
 
+/* With TFO or TCP_DEFER_ACCEPT the request data is already queued
+ * at accept time.  Consume it, as close() with unread data sends a
+ * RST instead of FIN, which the client reports as a failed connect.
+ */
+static void consume_request(int connfd)
+{
+	char buf[2048];
+
+	if (fastopen_qlen || defer_accept)
+		recv(connfd, buf, sizeof(buf), MSG_DONTWAIT);
+}
+
 void wait_for_connections(int listenfd, int count)
 {
 	int i;
@@ -97,6 +181,8 @@ void wait_for_connections(int listenfd, int count)
 		 * Thus, for fake SYN-floods this will not be woken-up.
 		 */
 		connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+		if (!start_ns)
+			start_ns = gettime();
 
 		if (write_something) {
 			/* Send/write something back into the TCP stream */
@@ -105,11 +191,13 @@ void wait_for_connections(int listenfd, int count)
 			write(connfd, send_buf, strlen(send_buf));
 		}
 
+		consume_request(connfd);
 		close(connfd);
 		if (verbose)
 			printf("PID:[%5d] Connection count: %d\n", pid, i);
 
 	}
+	stop_ns = gettime();
 }
 
 /* See: example in http://linux.die.net/man/7/epoll
@@ -118,10 +206,10 @@ void wait_for_connections(int listenfd, int count)
  *  http://stackoverflow.com/questions/21892697/epoll-io-with-worker-threads-in-c/21895563#21895563
  *
  */
-void epoll_connections(int epollfd, struct epoll_event *ev,
-		       int listen_sock, int count)
+int epoll_connections(int epollfd, struct epoll_event *ev,
+		      int listen_sock, int count)
 {
-	int i, n;
+	int i, n, accepts = 0;
 	pid_t pid = getpid();
 	int connfd, nfds;
 #define MAX_EVENTS 10
@@ -148,6 +236,8 @@ void epoll_connections(int epollfd, struct epoll_event *ev,
 					perror("accept");
 					exit(EXIT_FAILURE);
 				}
+				if (!accepts++)
+					start_ns = gettime();
 
 				//setnonblocking(connfd);
 				ev->events = EPOLLIN | EPOLLET;
@@ -174,11 +264,905 @@ void epoll_connections(int epollfd, struct epoll_event *ev,
 					write(connfd, send_buf, strlen(send_buf));
 				}
 
+				consume_request(connfd);
 				close(connfd);
 				// do_use_fd(events[n].data.fd);
 			}
 		}
 	}
+	stop_ns = gettime();
+	return accepts;
+}
+
+static void print_accept_rate(const char *mode, uint64_t accepts)
+{
+	double sec = (stop_ns - start_ns) / 1e9;
+
+	if (!accepts || sec <= 0)
+		return;
+	printf("%-15s accepts:%lu in %.3f sec = %.0f accepts/sec\n",
+	       mode, accepts, sec, accepts / sec);
+}
+
+/*** io_uring, via raw syscalls (no liburing dependency) ***/
+
+/* Multishot accept into direct descriptors needs kernel v5.19 uapi
+ * headers (also struct io_uring_sqe file_index), which cannot be
+ * provided by #define fallbacks.  Older headers build without it.
+ */
+#ifdef IORING_FILE_INDEX_ALLOC
+
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqe_tail;	/* local, published on submit */
+	unsigned to_submit;
+	uint64_t enters;	/* io_uring_enter syscalls */
+};
+
+#define UD_ACCEPT	1
+#define UD_WRITE	2
+#define UD_CLOSE	3
+#define UD_RECV		4
+
+static int uring_enter(struct uring *r, unsigned to_submit,
+		       unsigned min_complete)
+{
+	int res;
+
+	r->enters++;
+	res = syscall(SYS_io_uring_enter, r->fd, to_submit, min_complete,
+		      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (res < 0 && errno != EINTR && errno != EBUSY) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+	return res;
+}
+
+static void uring_setup(struct uring *r, unsigned entries)
+{
+	struct io_uring_params params;
+	size_t sq_sz, cq_sz;
+	void *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&params, 0, sizeof(params));
+	/* Room for a burst of accepts, before CQ is reaped */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	r->fd = syscall(SYS_io_uring_setup, entries, &params);
+	if (r->fd < 0) {
+		perror("io_uring_setup");
+		exit(EXIT_FAILURE);
+	}
+
+	sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_sz = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+
+	sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	cq = sq;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+		cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+		perror("io_uring mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	r->sq_entries = params.sq_entries;
+	r->sq_head  = sq + params.sq_off.head;
+	r->sq_tail  = sq + params.sq_off.tail;
+	r->sq_mask  = sq + params.sq_off.ring_mask;
+	r->sq_array = sq + params.sq_off.array;
+	r->cq_head  = cq + params.cq_off.head;
+	r->cq_tail  = cq + params.cq_off.tail;
+	r->cq_mask  = cq + params.cq_off.ring_mask;
+	r->cqes     = cq + params.cq_off.cqes;
+	r->sqe_tail = *r->sq_tail;
+}
+
+static void uring_submit(struct uring *r, unsigned min_complete)
+{
+	/* Publish SQEs to kernel */
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	uring_enter(r, r->to_submit, min_complete);
+	r->to_submit = 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+	    r->sq_entries)
+		uring_submit(r, 0); /* SQ full */
+
+	idx = r->sqe_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sqe_tail++;
+	r->to_submit++;
+	return sqe;
+}
+
+static void uring_prep_accept(struct uring *r, int listenfd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	if (uring_direct)
+		sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	sqe->user_data = UD_ACCEPT;
+}
+
+/* Optional write-back, hard linked to the close, so the close also
+ * happens when the write fails.  Successful completions are skipped,
+ * only errors generate CQEs.
+ */
+static void uring_prep_conn(struct uring *r, int fd, const char *buf,
+			    unsigned len)
+{
+	unsigned fixed = uring_direct ? IOSQE_FIXED_FILE : 0;
+	static char recv_buf[2048]; /* request data is discarded */
+	struct io_uring_sqe *sqe;
+
+	/* Keep the linked chain (max 3 SQEs) within one submit */
+	if (r->sq_entries - (r->sqe_tail -
+			     __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < 3)
+		uring_submit(r, 0);
+
+	/* Like consume_request(), avoid RST on close with unread data */
+	if (fastopen_qlen || defer_accept) {
+		sqe = uring_get_sqe(r);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->flags = fixed | IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe->addr = (unsigned long)recv_buf;
+		sqe->len = sizeof(recv_buf);
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data = UD_RECV;
+	}
+	if (write_something) {
+		sqe = uring_get_sqe(r);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->flags = fixed | IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = UD_WRITE;
+	}
+	sqe = uring_get_sqe(r);
+	sqe->opcode = IORING_OP_CLOSE;
+	if (uring_direct)
+		sqe->file_index = fd + 1; /* close direct descriptor */
+	else
+		sqe->fd = fd;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = UD_CLOSE;
+}
+
+static uint64_t uring_connections(int listenfd, int count)
+{
+	static char send_buf[1024];
+	struct io_uring_rsrc_register reg;
+	struct io_uring_cqe *cqe;
+	uint64_t accepts = 0, errors = 0, rearms = 0;
+	unsigned head, tail, len;
+	struct uring r;
+
+	snprintf(send_buf, sizeof(send_buf), "PID:[%5d] io_uring\r\n",
+		 getpid());
+	len = strlen(send_buf);
+
+	uring_setup(&r, 1024);
+
+	if (uring_direct) {
+		/* Sparse table, slots allocated by accept, freed by close */
+		memset(&reg, 0, sizeof(reg));
+		reg.nr = 4096;
+		reg.flags = IORING_RSRC_REGISTER_SPARSE;
+		if (syscall(SYS_io_uring_register, r.fd,
+			    IORING_REGISTER_FILES2, &reg, sizeof(reg)) < 0) {
+			perror("io_uring_register(FILES2)");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uring_prep_accept(&r, listenfd);
+
+	while (accepts < count) {
+		uring_submit(&r, 1);
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &r.cqes[head & *r.cq_mask];
+
+			if (cqe->user_data != UD_ACCEPT) {
+				errors++; /* only failed recv/write/close */
+				if (verbose)
+					fprintf(stderr, "WARN: %s failed: %s\n",
+						cqe->user_data == UD_RECV ?
+						"recv" :
+						cqe->user_data == UD_WRITE ?
+						"write" : "close",
+						strerror(-cqe->res));
+				continue;
+			}
+			if (cqe->res >= 0) {
+				if (!accepts++)
+					start_ns = gettime();
+				uring_prep_conn(&r, cqe->res, send_buf, len);
+			} else if (cqe->res != -ENFILE) {
+				fprintf(stderr, "ERROR: multishot accept: %s\n",
+					strerror(-cqe->res));
+				exit(EXIT_FAILURE);
+			}
+			/* Multishot terminated (e.g. CQ overflow or
+			 * direct table full), re-arm
+			 */
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				uring_prep_accept(&r, listenfd);
+				rearms++;
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	stop_ns = gettime();
+	/* Flush last closes, in-flight requests are done at ring exit */
+	uring_submit(&r, 0);
+
+	if (verbose)
+		printf(" - io_uring_enter calls:%lu (%.2f accepts/call)"
+		       " errors:%lu accept re-arms:%lu\n", r.enters,
+		       r.enters ? (double)accepts / r.enters : 0,
+		       errors, rearms);
+	close(r.fd);
+	return accepts;
+}
+#else
+static uint64_t uring_connections(int listenfd, int count)
+{
+	fprintf(stderr, "ERROR: --io-uring not supported, built without"
+		" kernel v5.19 io_uring headers\n");
+	exit(EXIT_FAIL_OPTION);
+}
+#endif /* IORING_FILE_INDEX_ALLOC */
+
+static int setup_listener(int addr_family, uint16_t listen_port)
+{
+	/* Support for both IPv4 and IPv6.
+	 *  sockaddr_storage: Can contain both sockaddr_in and sockaddr_in6
+	 */
+	struct sockaddr_storage listen_addr;
+	int listenfd;
+
+	memset(&listen_addr, 0, sizeof(listen_addr));
+
+	/* Socket setup stuff */
+	listenfd = Socket(addr_family, SOCK_STREAM, IPPROTO_IP);
+
+	/* Enable use of SO_REUSEPORT for multi-process testing  */
+	if (so_reuseport) {
+		if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+				&so_reuseport, sizeof(so_reuseport))) < 0) {
+			printf("ERROR: No support for SO_REUSEPORT\n");
+			perror("- setsockopt(SO_REUSEPORT)");
+			exit(EXIT_FAIL_SOCKOPT);
+		} else if (verbose) {
+			printf(" - Enabled SO_REUSEPORT\n");
+		}
+	}
+
+	/* Setup listen_addr depending on IPv4 or IPv6 address */
+	//setup_sockaddr(addr_family, &listen_addr, "0.0.0.0", listen_port);
+	if (addr_family == AF_INET) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)&listen_addr;
+		addr4->sin_family      = addr_family;
+		addr4->sin_port        = htons(listen_port);
+		addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+	} else if (addr_family == AF_INET6) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&listen_addr;
+		addr6->sin6_family= addr_family;
+		addr6->sin6_port  = htons(listen_port);
+	}
+
+	Bind(listenfd, &listen_addr);
+
+	/* Max queue of TFO requests, not yet completed 3WHS */
+	if (fastopen_qlen)
+		Setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+			   &fastopen_qlen, sizeof(fastopen_qlen));
+	/* Only wakeup accept() when data arrived, or timeout sec */
+	if (defer_accept)
+		Setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			   &defer_accept, sizeof(defer_accept));
+
+	/* Notice "backlog" limited by: /proc/sys/net/core/somaxconn */
+	listen(listenfd, 1024);
+
+	return listenfd;
+}
+
+/* Per thread state for --threads mode */
+struct sink_thread {
+	pthread_t thread;
+	int id;
+	int cpu;
+	int listenfd;
+	int epollfd;
+	/* Stats, read by main thread while running */
+	volatile uint64_t accepts;
+	uint64_t wakeups;	/* epoll_wait returned listen events */
+	uint64_t empty;		/* wakeup but accept queue already empty */
+	uint64_t last_accepts;	/* main thread: previous interval */
+	/* --latency */
+	struct histogram queue_delay;	/* client connected -> accept() */
+	struct histogram ack_delay;	/* TCP_INFO last_ack_recv (ms) */
+	struct histogram rtt;		/* TCP_INFO tcpi_rtt */
+	uint64_t retrans;
+	uint64_t no_stamp;
+	struct lat_conn *pending;	/* waiting for client stamp */
+	uint64_t xcpu;		/* SO_INCOMING_CPU != listener CPU */
+};
+
+/* Connection waiting for client time stamp, with --latency */
+struct lat_conn {
+	int fd;
+	uint64_t accept_ns;
+	struct lat_conn *prev, *next;	/* on sink_thread pending list */
+};
+
+static void latency_accepted(struct sink_thread *t, int connfd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	struct lat_conn *lc;
+	struct epoll_event ev;
+
+	lc = malloc(sizeof(*lc));
+	if (!lc) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	lc->fd = connfd;
+	lc->accept_ns = gettime();
+	lc->prev = NULL;
+	lc->next = t->pending;
+	if (t->pending)
+		t->pending->prev = lc;
+	t->pending = lc;
+
+	/* Kernel view of the handshake, before the stamp arrives */
+	if (!getsockopt(connfd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+		histogram_add(&t->rtt, info.tcpi_rtt * 1000ULL);
+		histogram_add(&t->ack_delay,
+			      info.tcpi_last_ack_recv * 1000000ULL);
+		t->retrans += info.tcpi_total_retrans;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = lc;
+	if (epoll_ctl(t->epollfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+		perror("epoll_ctl: conn_sock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void latency_release(struct sink_thread *t, struct lat_conn *lc)
+{
+	if (lc->prev)
+		lc->prev->next = lc->next;
+	else
+		t->pending = lc->next;
+	if (lc->next)
+		lc->next->prev = lc->prev;
+	close(lc->fd); /* also removes it from epoll */
+	free(lc);
+}
+
+/* Client stamp is CLOCK_MONOTONIC when it saw connect() complete */
+static void latency_stamp(struct sink_thread *t, struct lat_conn *lc)
+{
+	uint64_t stamp;
+	ssize_t res;
+
+	res = recv(lc->fd, &stamp, sizeof(stamp), 0);
+	if (res < 0 && errno == EAGAIN)
+		return;
+	if (res == sizeof(stamp))
+		histogram_add(&t->queue_delay, lc->accept_ns > stamp ?
+			      lc->accept_ns - stamp : 0);
+	else
+		t->no_stamp++;
+	latency_release(t, lc);
+}
+
+/* After the last accept, wait a while for stamps still in flight.
+ * Connections that never deliver one are counted as no_stamp.
+ */
+static void latency_drain(struct sink_thread *t)
+{
+	uint64_t deadline = gettime() + 1000000000ULL;
+	struct epoll_event events[MAX_EVENTS];
+	int n, nfds;
+
+	while (t->pending && gettime() < deadline) {
+		nfds = epoll_wait(t->epollfd, events, MAX_EVENTS, 100);
+		for (n = 0; n < nfds; n++) {
+			/* Listener (data.ptr NULL) no longer accepted */
+			if (events[n].data.ptr)
+				latency_stamp(t, events[n].data.ptr);
+		}
+	}
+	while (t->pending) {
+		t->no_stamp++;
+		latency_release(t, t->pending);
+	}
+}
+
+static volatile int threads_stop;
+static uint64_t total_accepts;	/* atomic, across threads */
+static int total_count;
+
+/* Count connections whose packets were processed on another CPU
+ * than the one running this listener thread.  Cross-CPU accepts cost
+ * cache-line transfers of the socket.
+ */
+static void check_incoming_cpu(struct sink_thread *t, int connfd)
+{
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len))
+		return;
+	if (cpu != t->cpu)
+		t->xcpu++;
+}
+
+static void *sink_thread_run(void *arg)
+{
+	struct sink_thread *t = arg;
+	struct epoll_event events[MAX_EVENTS];
+	char send_buf[1024];	/* per thread, not static */
+	int connfd, nfds, drained;
+	uint64_t total;
+	int n, listen_ev;
+
+	pin_to_cpu(t->cpu);
+	histogram_init(&t->queue_delay);
+	histogram_init(&t->ack_delay);
+	histogram_init(&t->rtt);
+
+	while (!threads_stop) {
+		/* Timeout to notice threads_stop, when other threads
+		 * received the last connections.
+		 */
+		nfds = epoll_wait(t->epollfd, events, MAX_EVENTS, 100);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		if (nfds == 0)
+			continue;
+		listen_ev = !latency_mode;
+		if (latency_mode) {
+			/* Listener registered with data.ptr NULL */
+			for (n = 0; n < nfds; n++) {
+				if (events[n].data.ptr)
+					latency_stamp(t, events[n].data.ptr);
+				else
+					listen_ev = 1;
+			}
+		}
+		if (!listen_ev)
+			continue;
+		t->wakeups++;
+
+		/* Drain the accept queue of this listener */
+		drained = 0;
+		while ((connfd = accept4(t->listenfd, NULL, NULL,
+					 SOCK_NONBLOCK)) >= 0) {
+			drained++;
+			check_incoming_cpu(t, connfd);
+			if (write_something) {
+				snprintf(send_buf, sizeof(send_buf),
+					 "TID:[%d] cnt:%lu\r\n", t->id,
+					 t->accepts);
+				write(connfd, send_buf, strlen(send_buf));
+			}
+			if (latency_mode) {
+				latency_accepted(t, connfd);
+			} else {
+				consume_request(connfd);
+				close(connfd);
+			}
+			t->accepts++;
+
+			if (!start_ns)
+				__sync_bool_compare_and_swap(&start_ns, 0,
+							     gettime());
+			total = __sync_add_and_fetch(&total_accepts, 1);
+			if (total == total_count) {
+				stop_ns = gettime();
+				threads_stop = 1;
+			}
+		}
+		if (errno != EAGAIN && errno != ECONNABORTED) {
+			perror("accept4");
+			exit(EXIT_FAILURE);
+		}
+		if (!drained)
+			t->empty++;
+	}
+	if (latency_mode)
+		latency_drain(t);
+	return NULL;
+}
+
+static void print_thread_stats(struct sink_thread *threads, int nr,
+			       long long overflows, long long drops)
+{
+	double sec = (stop_ns - start_ns) / 1e9;
+	double mean, var = 0, rate, max = 0, min = -1;
+	int i;
+
+	if (sec <= 0)
+		sec = 1e-9;
+	mean = (double)total_accepts / nr / sec;
+
+	printf("\n%-6s %4s %10s %12s %7s %10s %8s %7s\n", "thread", "cpu",
+	       "accepts", "accepts/sec", "share", "wakeups", "empty",
+	       "xcpu");
+	for (i = 0; i < nr; i++) {
+		struct sink_thread *t = &threads[i];
+
+		rate = t->accepts / sec;
+		var += (rate - mean) * (rate - mean);
+		if (rate > max)
+			max = rate;
+		if (min < 0 || rate < min)
+			min = rate;
+		printf("%-6d %4d %10lu %12.0f %6.1f%% %10lu %8lu %6.1f%%\n",
+		       t->id, t->cpu, t->accepts, rate,
+		       total_accepts ? 100.0 * t->accepts / total_accepts : 0,
+		       t->wakeups, t->empty,
+		       t->accepts ? 100.0 * t->xcpu / t->accepts : 0);
+	}
+	printf("%-6s %4s %10lu %12.0f\n", "total", "", total_accepts,
+	       total_accepts / sec);
+	/* Imbalance: busiest thread vs. mean, and coefficient of variation */
+	printf(" - imbalance: max/mean %.2f min/mean %.2f CoV %.1f%%"
+	       " (time:%.3f sec)\n",
+	       mean ? max / mean : 0, mean ? min / mean : 0,
+	       mean ? 100.0 * sqrt(var / nr) / mean : 0, sec);
+	printf(" - TcpExt ListenOverflows:%lld ListenDrops:%lld steer:%s\n",
+	       overflows, drops, steer_names[steer_mode]);
+}
+
+/* Classic BPF, like enable_bpf() in udp_sink.c: return index of the
+ * socket in the reuseport group (listen order) equal to the CPU
+ * processing the SYN, modulo the number of listeners.
+ */
+static int attach_cbpf_cpu(int listenfd, int nr)
+{
+	struct sock_filter code[] = {
+		/* A = raw_smp_processor_id() */
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* A = A % nr */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nr },
+		/* return A */
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog p = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &p, sizeof(p));
+}
+
+/* Raw bpf() syscall, avoids libbpf dependency */
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(_code, _dst, _src, _off, _imm)				\
+	((struct bpf_insn){ .code = _code, .dst_reg = _dst,		\
+			    .src_reg = _src, .off = _off, .imm = _imm })
+
+/* eBPF SK_REUSEPORT program, hand assembled:
+ *
+ *  key = (by_cpu ? bpf_get_smp_processor_id() : reuse->hash) % nr;
+ *  bpf_sk_select_reuseport(reuse, &sockarray, &key, 0);
+ *  return SK_PASS;
+ *
+ * When select fails, SK_PASS falls back to the kernel hash.
+ */
+static int load_ebpf_prog(int map_fd, int nr, int by_cpu)
+{
+	struct bpf_insn prog[] = {
+		/* r6 = ctx */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		by_cpu ?
+		/* r0 = bpf_get_smp_processor_id() */
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		     BPF_FUNC_get_smp_processor_id) :
+		/* r0 = reuse->hash */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+		     offsetof(struct sk_reuseport_md, hash), 0),
+		/* r0 %= nr */
+		INSN(BPF_ALU | BPF_MOD | BPF_K, BPF_REG_0, 0, 0, nr),
+		/* *(u32 *)(fp - 4) = r0 */
+		INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0),
+		/* r1 = ctx, r2 = map, r3 = fp - 4, r4 = 0 */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD,
+		     0, map_fd),
+		INSN(0, 0, 0, 0, 0), /* second half of 64-bit imm */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		     BPF_FUNC_sk_select_reuseport),
+		/* return SK_PASS */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static char log_buf[4096];
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.insns     = (unsigned long)prog;
+	attr.insn_cnt  = sizeof(prog) / sizeof(prog[0]);
+	attr.license   = (unsigned long)"GPL";
+	attr.log_buf   = (unsigned long)log_buf;
+	attr.log_size  = sizeof(log_buf);
+	attr.log_level = 1;
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		fprintf(stderr, "ERROR: BPF_PROG_LOAD failed: %s\n%s\n",
+			strerror(errno), log_buf);
+	return fd;
+}
+
+/* Sockarray map: key thread index, value listen socket fd */
+static int setup_ebpf_steering(struct sink_thread *threads, int nr,
+			       int by_cpu)
+{
+	union bpf_attr attr;
+	int map_fd, prog_fd, i;
+	uint32_t key;
+	uint64_t value;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type    = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+	attr.key_size    = sizeof(key);
+	attr.value_size  = sizeof(value);
+	attr.max_entries = nr;
+	map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (map_fd < 0) {
+		perror("bpf(BPF_MAP_CREATE, REUSEPORT_SOCKARRAY)");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		key = i;
+		value = threads[i].listenfd;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key    = (unsigned long)&key;
+		attr.value  = (unsigned long)&value;
+		attr.flags  = BPF_ANY;
+		if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+			perror("bpf(BPF_MAP_UPDATE_ELEM)");
+			return -1;
+		}
+	}
+
+	prog_fd = load_ebpf_prog(map_fd, nr, by_cpu);
+	if (prog_fd < 0)
+		return -1;
+	/* Program is attached to the whole reuseport group */
+	if (setsockopt(threads[0].listenfd, SOL_SOCKET,
+		       SO_ATTACH_REUSEPORT_EBPF, &prog_fd, sizeof(prog_fd))) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_EBPF)");
+		return -1;
+	}
+	/* Socket and map keep references to program and map */
+	close(prog_fd);
+	close(map_fd);
+	return 0;
+}
+
+/* Steering by CPU only makes sense with listener i pinned to CPU i */
+static void setup_steering(struct sink_thread *threads, int nr)
+{
+	int res = 0;
+
+	switch (steer_mode) {
+	case STEER_HASH:
+		return;
+	case STEER_CBPF:
+		res = attach_cbpf_cpu(threads[0].listenfd, nr);
+		if (res)
+			perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		break;
+	case STEER_EBPF_HASH:
+	case STEER_EBPF_CPU:
+		res = setup_ebpf_steering(threads, nr,
+					  steer_mode == STEER_EBPF_CPU);
+		break;
+	}
+	if (res) {
+		fprintf(stderr, "ERROR: cannot setup --steer %s\n",
+			steer_names[steer_mode]);
+		exit(EXIT_FAIL_SOCKOPT);
+	}
+	if (verbose)
+		printf(" - SO_REUSEPORT steering: %s\n",
+		       steer_names[steer_mode]);
+}
+
+/* Accept-queue delay per listener thread shows SO_REUSEPORT
+ * imbalance, where one busy thread lets its queue build up.
+ */
+static void print_latency_stats(struct sink_thread *threads, int nr)
+{
+	struct histogram delay, ack, rtt;
+	uint64_t retrans = 0, no_stamp = 0;
+	char name[64];
+	int i;
+
+	histogram_init(&delay);
+	histogram_init(&ack);
+	histogram_init(&rtt);
+	printf("\nAccept-queue delay per listener thread"
+	       " (client connected -> accept):\n");
+	for (i = 0; i < nr; i++) {
+		struct sink_thread *t = &threads[i];
+
+		snprintf(name, sizeof(name), "thread %d", t->id);
+		histogram_print_summary(&t->queue_delay, name, "ns");
+		histogram_merge(&delay, &t->queue_delay);
+		histogram_merge(&ack, &t->ack_delay);
+		histogram_merge(&rtt, &t->rtt);
+		retrans  += t->retrans;
+		no_stamp += t->no_stamp;
+	}
+	if (verbose)
+		histogram_print(&delay, "all threads", "ns");
+	else
+		histogram_print_summary(&delay, "all threads", "ns");
+	histogram_print_summary(&ack, "TCP_INFO last_ack_recv", "ns");
+	histogram_print_summary(&rtt, "TCP_INFO rtt", "ns");
+	printf(" - retransmits:%lu connections without stamp:%lu\n",
+	       retrans, no_stamp);
+}
+
+/* Each thread get its own listen socket in the same SO_REUSEPORT
+ * group, and its own epoll instance.  Listeners are all created
+ * before threads start, so the group is complete before the kernel
+ * starts hashing connections to it.
+ */
+static int run_threads(int addr_family, uint16_t listen_port, int count)
+{
+	long long overflows, drops;
+	struct sink_thread *threads;
+	struct epoll_event ev;
+	int nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t now_accepts, prev_ns, now;
+	int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "ERROR: cannot alloc %d threads\n",
+			nr_threads);
+		exit(EXIT_FAIL_MEM);
+	}
+	total_count = count;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct sink_thread *t = &threads[i];
+
+		t->id  = i;
+		t->cpu = i % nr_cpus;
+		t->listenfd = setup_listener(addr_family, listen_port);
+		/* Accept queue is drained until EAGAIN */
+		fcntl(t->listenfd, F_SETFL, O_NONBLOCK);
+		t->epollfd = epoll_create1(0);
+		if (t->epollfd == -1) {
+			perror("epoll_create");
+			exit(EXIT_FAILURE);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL; /* connections use a pointer */
+		if (epoll_ctl(t->epollfd, EPOLL_CTL_ADD, t->listenfd,
+			      &ev) == -1) {
+			perror(" - epoll_ctl: cannot add listen sock");
+			exit(EXIT_FAILURE);
+		}
+	}
+	setup_steering(threads, nr_threads);
+
+	overflows = read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					 "ListenOverflows");
+	drops     = read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					 "ListenDrops");
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, sink_thread_run,
+				   &threads[i])) {
+			fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (verbose)
+		printf("Started %d listener threads on %d CPUs\n",
+		       nr_threads, nr_cpus < nr_threads ? nr_cpus : nr_threads);
+
+	/* Per second accepts/sec of each thread */
+	prev_ns = gettime();
+	while (!threads_stop) {
+		usleep(100000);
+		now = gettime();
+		if (now - prev_ns < 1000000000ULL && !threads_stop)
+			continue;
+		if (verbose && start_ns) {
+			printf("accepts/sec:");
+			for (i = 0; i < nr_threads; i++) {
+				now_accepts = threads[i].accepts;
+				printf(" t%d:%.0f", i,
+				       (now_accepts - threads[i].last_accepts)
+				       * 1e9 / (now - prev_ns));
+				threads[i].last_accepts = now_accepts;
+			}
+			printf("\n");
+		}
+		prev_ns = now;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	overflows = read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					 "ListenOverflows") - overflows;
+	drops     = read_netstat_counter(PROC_NET_NETSTAT, "TcpExt",
+					 "ListenDrops") - drops;
+	print_thread_stats(threads, nr_threads, overflows, drops);
+	if (latency_mode)
+		print_latency_stats(threads, nr_threads);
+
+	for (i = 0; i < nr_threads; i++) {
+		close(threads[i].epollfd);
+		close(threads[i].listenfd);
+	}
+	free(threads);
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -188,6 +1172,8 @@ int main(int argc, char *argv[])
 	int c;
 	int count  = 1000000;
 	pid_t pid = getpid();
+	long long tfo_vals[NR_TFO_COUNTERS];
+	int res = 0;
 
 	/* Epoll variables */
 	struct epoll_event ev;
@@ -197,15 +1183,8 @@ int main(int argc, char *argv[])
 	int addr_family = AF_INET; /* Default address family */
 	uint16_t listen_port = 6666;
 
-	/* Support for both IPv4 and IPv6.
-	 *  sockaddr_storage: Can contain both sockaddr_in and sockaddr_in6
-	 */
-	struct sockaddr_storage listen_addr;
-
-	memset(&listen_addr, 0, sizeof(listen_addr));
-
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "c:l:64swv:",
+	while ((c = getopt_long(argc, argv, "c:l:64swv:t:S:F:D:",
 			long_options, &longindex)) != -1) {
 		if (c == 0) { /* optional handling "flag" options */
 			if (verbose) {
@@ -220,6 +1199,17 @@ int main(int argc, char *argv[])
 		if (c == '4') addr_family = AF_INET;
 		if (c == '6') addr_family = AF_INET6;
 		if (c == 'w') write_something = 1;
+		if (c == 't') nr_threads  = atoi(optarg);
+		if (c == 'F') fastopen_qlen = atoi(optarg);
+		if (c == 'D') defer_accept  = atoi(optarg);
+		if (c == 'S') {
+			for (steer_mode = STEER_EBPF_CPU; steer_mode > 0;
+			     steer_mode--)
+				if (!strcmp(optarg, steer_names[steer_mode]))
+					break;
+			if (strcmp(optarg, steer_names[steer_mode]))
+				return usage(argv);
+		}
 		if (c == 'v') (optarg) ? verbose = atoi(optarg) : (verbose = 1);
 		if (c == '?') return usage(argv);
 	}
@@ -229,41 +1219,38 @@ int main(int argc, char *argv[])
 		       (addr_family == AF_INET6) ? "v6":"v4",
 		       listen_port, pid);
 
-	/* Socket setup stuff */
-	listenfd = Socket(addr_family, SOCK_STREAM, IPPROTO_IP);
-
-	/* Enable use of SO_REUSEPORT for multi-process testing  */
-	if (so_reuseport) {
-		if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
-				&so_reuseport, sizeof(so_reuseport))) < 0) {
-			printf("ERROR: No support for SO_REUSEPORT\n");
-			perror("- setsockopt(SO_REUSEPORT)");
-			exit(EXIT_FAIL_SOCKOPT);
-		} else if (verbose) {
-			printf(" - Enabled SO_REUSEPORT\n");
-		}
+	/* Stamp must be the first bytes of the stream */
+	if (latency_mode && (fastopen_qlen || defer_accept)) {
+		fprintf(stderr, "ERROR: --latency cannot be combined with"
+			" --fastopen or --defer-accept\n");
+		return usage(argv);
 	}
-
-	/* Setup listen_addr depending on IPv4 or IPv6 address */
-	//setup_sockaddr(addr_family, &listen_addr, "0.0.0.0", listen_port);
-	if (addr_family == AF_INET) {
-		struct sockaddr_in *addr4 = (struct sockaddr_in *)&listen_addr;
-		addr4->sin_family      = addr_family;
-		addr4->sin_port        = htons(listen_port);
-		addr4->sin_addr.s_addr = htonl(INADDR_ANY);
-	} else if (addr_family == AF_INET6) {
-		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&listen_addr;
-		addr6->sin6_family= addr_family;
-		addr6->sin6_port  = htons(listen_port);
+	if (latency_mode && nr_threads <= 0) {
+		fprintf(stderr, "ERROR: --latency needs --threads\n");
+		return usage(argv);
 	}
+	/* Server side TFO must be enabled by sysctl bit 0x2 */
+	if (fastopen_qlen &&
+	    !(read_proc_int(PROC_TCP_FASTOPEN) & TFO_SERVER_ENABLE))
+		fprintf(stderr, "WARN: TFO server disabled, set sysctl"
+			" net.ipv4.tcp_fastopen=3\n");
+	tcpext_snapshot(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
 
-	Bind(listenfd, &listen_addr);
+	if (nr_threads > 0) {
+		if (!so_reuseport) {
+			fprintf(stderr, "ERROR: --threads needs SO_REUSEPORT\n");
+			return usage(argv);
+		}
+		res = run_threads(addr_family, listen_port, count);
+		goto out;
+	}
 
-	/* Notice "backlog" limited by: /proc/sys/net/core/somaxconn */
-	listen(listenfd, 1024);
+	listenfd = setup_listener(addr_family, listen_port);
 
-	/* Epoll */
-	if (use_epoll) {
+	if (use_uring) {
+		print_accept_rate(uring_direct ? "io_uring-direct" : "io_uring",
+				  uring_connections(listenfd, count));
+	} else if (use_epoll) {
 		epollfd = epoll_create1(0);
 		if (epollfd == -1) {
 			perror("epoll_create");
@@ -278,14 +1265,20 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 
-		epoll_connections(epollfd, &ev, listenfd, count);
+		print_accept_rate("epoll",
+				  epoll_connections(epollfd, &ev, listenfd,
+						    count));
 
 		close(epollfd);
 
 	} else {
 		wait_for_connections(listenfd, count);
+		print_accept_rate("accept", count);
 	}
 
 	close(listenfd);
-	return 0;
+out:
+	if (fastopen_qlen || defer_accept)
+		tcpext_print_delta(tfo_counters, tfo_vals, NR_TFO_COUNTERS);
+	return res;
 }
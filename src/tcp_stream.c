@@ -0,0 +1,495 @@
+/* -*- c-file-style: "linux" -*-
+ * Author: Jesper Dangaard Brouer <netoptimizer@brouer.com>
+ * License: GPLv2
+ * From: https://github.com/netoptimizer/network-testing
+ */
+static const char *__doc__=
+ " Bulk TCP throughput test, for measuring the cost of copying.\n"
+ "\n"
+ " Server mode (--server) receives streams with --recv MODE:\n"
+ "  read     : read() into a user buffer (copy)\n"
+ "  splice   : splice() socket -> pipe -> /dev/null (no user copy)\n"
+ "  zerocopy : TCP_ZEROCOPY_RECEIVE, maps page aligned payload into\n"
+ "             user space, the remainder is read() (copy).  Needs an\n"
+ "             MSS that is a multiple of PAGE_SIZE, see --mss.\n"
+ " Client mode sends for --duration sec with --send MODE:\n"
+ "  write    : write() from a user buffer (copy)\n"
+ "  zerocopy : send() with MSG_ZEROCOPY, completions reaped from the\n"
+ "             socket error queue.  Over loopback/veth the kernel\n"
+ "             falls back to copying (reported as 'copied').\n"
+ "\n"
+ " Reports Gbit/s and CPU cycles per byte (CPU time from getrusage,\n"
+ " converted using the measured TSC rate).\n"
+ ;
+
+#define _GNU_SOURCE /* needed for getopt.h and splice */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <linux/errqueue.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include "global.h"
+#include "common.h"
+#include "common_socket.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+
+enum {
+	MODE_COPY = 0,	/* read() or write() */
+	MODE_SPLICE,
+	MODE_ZEROCOPY,
+};
+
+static const char *mode_names[] = {
+	[MODE_COPY]	= "copy",
+	[MODE_SPLICE]	= "splice",
+	[MODE_ZEROCOPY]	= "zerocopy",
+};
+
+/* Global config setting, default values adjustable via getopt_long */
+static int server_mode = 0;
+static int recv_mode = MODE_COPY;
+static int send_mode = MODE_COPY;
+static int buf_size = 128 * 1024;
+static int duration = 5;
+static int mss = 0;
+static int sock_buf = 0;	/* SO_SNDBUF/SO_RCVBUF, 0 = autotune */
+
+static struct option long_options[] = {
+	{"help",	no_argument,		NULL, 'h' },
+	{"server",	no_argument,		NULL, 's' },
+	{"ipv4",	no_argument,		NULL, '4' },
+	{"ipv6",	no_argument,		NULL, '6' },
+	{"port",	required_argument,	NULL, 'p' },
+	{"recv",	required_argument,	NULL, 'R' },
+	{"send",	required_argument,	NULL, 'S' },
+	{"buf-size",	required_argument,	NULL, 'b' },
+	{"sock-buf",	required_argument,	NULL, 'B' },
+	{"mss",		required_argument,	NULL, 'M' },
+	{"duration",	required_argument,	NULL, 'd' },
+	{"verbose",	optional_argument,	NULL, 'v' },
+	{"quiet",	no_argument,		&verbose, 0 },
+	{0, 0, NULL,  0 }
+};
+
+static int usage(char *argv[])
+{
+	int i;
+
+	printf("\nDOCUMENTATION:\n%s\n", __doc__);
+	printf(" Usage: %s --server [--recv read|splice|zerocopy]\n"
+	       "        %s [--send write|zerocopy] IP-addr\n\n",
+	       argv[0], argv[0]);
+	printf(" Listing options:\n");
+	for (i = 0; long_options[i].name != 0; i++) {
+		printf(" --%-12s", long_options[i].name);
+		if (long_options[i].flag != NULL)
+			printf(" flag (internal value:%d)",
+			       *long_options[i].flag);
+		else
+			printf(" short-option: -%c",
+			       long_options[i].val);
+		printf("\n");
+	}
+	printf("\n");
+	return EXIT_FAIL_OPTION;
+}
+
+static int parse_mode(const char *arg, int allow_splice)
+{
+	if (!strcmp(arg, "read") || !strcmp(arg, "write"))
+		return MODE_COPY;
+	if (allow_splice && !strcmp(arg, "splice"))
+		return MODE_SPLICE;
+	if (!strcmp(arg, "zerocopy"))
+		return MODE_ZEROCOPY;
+	fprintf(stderr, "ERROR: unknown mode: %s\n", arg);
+	return -1;
+}
+
+/* Throughput and CPU cost of a transfer */
+struct stream_stats {
+	uint64_t bytes;
+	uint64_t bytes_mapped;	/* zerocopy recv: mapped, not copied */
+	uint64_t calls;		/* syscalls moving data */
+	uint64_t zc_sends;	/* zerocopy send: completions */
+	uint64_t zc_copied;	/* zerocopy send: kernel fell back to copy */
+	uint64_t time_start, time_stop;
+	uint64_t tsc_start, tsc_stop;
+	struct rusage ru_start, ru_stop;
+};
+
+static void stats_start(struct stream_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	getrusage(RUSAGE_THREAD, &st->ru_start);
+	st->time_start = gettime();
+	st->tsc_start  = rdtsc();
+}
+
+static void stats_stop(struct stream_stats *st)
+{
+	st->tsc_stop  = rdtsc();
+	st->time_stop = gettime();
+	getrusage(RUSAGE_THREAD, &st->ru_stop);
+}
+
+static double tv_sec(struct timeval *a, struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void stats_print(struct stream_stats *st, const char *name)
+{
+	double sec = (st->time_stop - st->time_start) / 1e9;
+	double tsc_hz, cpu_sec, usr, sys;
+
+	if (sec <= 0)
+		return;
+	tsc_hz = (st->tsc_stop - st->tsc_start) / sec;
+	usr = tv_sec(&st->ru_start.ru_utime, &st->ru_stop.ru_utime);
+	sys = tv_sec(&st->ru_start.ru_stime, &st->ru_stop.ru_stime);
+	cpu_sec = usr + sys;
+
+	printf("%-9s bytes:%lu in %.3f sec = %.2f Gbit/s"
+	       " cpu:%.0f%% (usr:%.0f%% sys:%.0f%%)"
+	       " %.3f cycles/byte\n",
+	       name, st->bytes, sec, st->bytes * 8 / sec / 1e9,
+	       100 * cpu_sec / sec, 100 * usr / sec, 100 * sys / sec,
+	       st->bytes ? cpu_sec * tsc_hz / st->bytes : 0);
+	if (verbose)
+		printf(" - calls:%lu (%.0f bytes/call)\n", st->calls,
+		       st->calls ? (double)st->bytes / st->calls : 0);
+	if (st->bytes_mapped)
+		printf(" - zerocopy mapped:%lu (%.1f%%) copied:%lu\n",
+		       st->bytes_mapped, 100.0 * st->bytes_mapped / st->bytes,
+		       st->bytes - st->bytes_mapped);
+	if (st->zc_sends)
+		printf(" - zerocopy completions:%lu copied:%lu\n",
+		       st->zc_sends, st->zc_copied);
+}
+
+static void set_sock_opts(int fd)
+{
+	if (mss)
+		Setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+	if (sock_buf) {
+		Setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sock_buf,
+			   sizeof(sock_buf));
+		Setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sock_buf,
+			   sizeof(sock_buf));
+	}
+}
+
+/*** Receiver ***/
+
+static void recv_read(int fd, struct stream_stats *st)
+{
+	char *buf = malloc_payload_buffer(buf_size);
+	ssize_t res;
+
+	while ((res = read(fd, buf, buf_size)) > 0) {
+		st->bytes += res;
+		st->calls++;
+	}
+	if (res < 0)
+		perror("read");
+	free(buf);
+}
+
+static void recv_splice(int fd, struct stream_stats *st)
+{
+	int pipefd[2], devnull;
+	ssize_t res, out;
+
+	devnull = open("/dev/null", O_WRONLY);
+	if (devnull < 0 || pipe(pipefd) < 0) {
+		perror("splice setup");
+		exit(EXIT_FAIL_FILEACCESS);
+	}
+	/* Pipe must hold a full chunk */
+	fcntl(pipefd[1], F_SETPIPE_SZ, buf_size);
+
+	while ((res = splice(fd, NULL, pipefd[1], NULL, buf_size,
+			     SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+		st->bytes += res;
+		st->calls++;
+		while (res > 0) {
+			out = splice(pipefd[0], NULL, devnull, NULL, res,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out <= 0) {
+				perror("splice to /dev/null");
+				exit(EXIT_FAIL_FILEACCESS);
+			}
+			res -= out;
+		}
+	}
+	if (res < 0)
+		perror("splice");
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(devnull);
+}
+
+/* Based on the kernel selftest tools/testing/selftests/net/tcp_mmap.c */
+static void recv_zerocopy(int fd, struct stream_stats *st)
+{
+	struct tcp_zerocopy_receive zc;
+	socklen_t zc_len = sizeof(zc);
+	char *buf = malloc_payload_buffer(buf_size);
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t map_size;
+	void *addr;
+	ssize_t res;
+	int lowat;
+
+	map_size = (buf_size + page_size - 1) & ~(page_size - 1);
+	addr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap(TCP socket)");
+		exit(EXIT_FAIL_SOCK);
+	}
+	/* Wakeup with a full chunk, more pages mapped per call */
+	lowat = map_size;
+	setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+
+	while (1) {
+		memset(&zc, 0, sizeof(zc));
+		zc.address = (unsigned long)addr;
+		zc.length  = map_size;
+		if (getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE,
+			       &zc, &zc_len) < 0) {
+			/* E.g. EIO after peer shutdown, let read() decide */
+			if (errno != EIO)
+				perror("getsockopt(TCP_ZEROCOPY_RECEIVE)");
+			memset(&zc, 0, sizeof(zc));
+		}
+		st->calls++;
+		if (zc.length) {
+			st->bytes += zc.length;
+			st->bytes_mapped += zc.length;
+		}
+		if (zc.recv_skip_hint) {
+			/* Non page aligned part, must be copied */
+			res = read(fd, buf, zc.recv_skip_hint < buf_size ?
+				   zc.recv_skip_hint : buf_size);
+			if (res <= 0)
+				break;
+			st->bytes += res;
+			st->calls++;
+		} else if (!zc.length) {
+			/* Nothing mapped or to skip, check for EOF */
+			res = read(fd, buf, buf_size);
+			if (res <= 0)
+				break;
+			st->bytes += res;
+			st->calls++;
+		}
+	}
+	munmap(addr, map_size);
+	free(buf);
+}
+
+static int run_server(int addr_family, uint16_t port)
+{
+	struct sockaddr_storage addr;
+	struct stream_stats st;
+	int listenfd, fd, on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	setup_sockaddr(addr_family, &addr,
+		       addr_family == AF_INET6 ? "::" : "0.0.0.0", port);
+	listenfd = Socket(addr_family, SOCK_STREAM, IPPROTO_TCP);
+	Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	/* Options inherited by accepted sockets, e.g. MSS */
+	set_sock_opts(listenfd);
+	Bind(listenfd, &addr);
+	if (listen(listenfd, 16) < 0) {
+		perror("listen");
+		exit(EXIT_FAIL_SOCK);
+	}
+	printf("Server listen port:%d recv mode:%s buf-size:%d\n",
+	       port, recv_mode == MODE_COPY ? "read" : mode_names[recv_mode],
+	       buf_size);
+
+	/* One stream at the time, report per stream */
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+		stats_start(&st);
+		switch (recv_mode) {
+		case MODE_COPY:
+			recv_read(fd, &st);
+			break;
+		case MODE_SPLICE:
+			recv_splice(fd, &st);
+			break;
+		case MODE_ZEROCOPY:
+			recv_zerocopy(fd, &st);
+			break;
+		}
+		stats_stop(&st);
+		close(fd);
+		stats_print(&st, recv_mode == MODE_COPY ? "read" :
+			    mode_names[recv_mode]);
+		fflush(stdout);
+	}
+	perror("accept");
+	close(listenfd);
+	return EXIT_FAIL_SOCK;
+}
+
+/*** Sender ***/
+
+/* Reap MSG_ZEROCOPY completions, returns number of sends completed.
+ * Each notification covers the range of send calls ee_info..ee_data.
+ */
+static uint64_t reap_zerocopy(int fd, struct stream_stats *st, int block)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	struct pollfd pfd = { .fd = fd, .events = 0 };
+	uint64_t done = 0, n;
+
+	if (block)
+		poll(&pfd, 1, 100); /* POLLERR always reported */
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN)
+				perror("recvmsg(MSG_ERRQUEUE)");
+			break;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP &&
+			       cmsg->cmsg_type == IP_RECVERR) ||
+			      (cmsg->cmsg_level == SOL_IPV6 &&
+			       cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = (void *)CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			n = serr->ee_data - serr->ee_info + 1;
+			done += n;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				st->zc_copied += n;
+		}
+	}
+	st->zc_sends += done;
+	return done;
+}
+
+static int run_client(struct sockaddr_storage *dest_addr)
+{
+	char *buf = malloc_payload_buffer(buf_size);
+	uint64_t outstanding = 0, end;
+	struct stream_stats st;
+	int fd, on = 1, flags = 0;
+	ssize_t res;
+
+	fd = Socket(dest_addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+	set_sock_opts(fd);
+	if (send_mode == MODE_ZEROCOPY) {
+		Setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+		flags = MSG_ZEROCOPY;
+	}
+	Connect(fd, (struct sockaddr *)dest_addr, sockaddr_len(dest_addr));
+
+	/* Buffer is never modified, no need to wait for completions
+	 * before reuse, only to bound the notifications (optmem).
+	 */
+	stats_start(&st);
+	end = st.time_start + (uint64_t)duration * 1000000000ULL;
+	while (gettime() < end) {
+		res = send(fd, buf, buf_size, flags);
+		if (res < 0) {
+			if (errno == ENOBUFS && flags) {
+				/* optmem limit, wait for completions */
+				outstanding -= reap_zerocopy(fd, &st, 1);
+				continue;
+			}
+			perror("send");
+			break;
+		}
+		st.bytes += res;
+		st.calls++;
+		if (flags) {
+			outstanding++;
+			if (outstanding > 64)
+				outstanding -= reap_zerocopy(fd, &st, 0);
+		}
+	}
+	shutdown(fd, SHUT_WR);
+	while (flags && outstanding > 0 && gettime() < end + 1000000000ULL)
+		outstanding -= reap_zerocopy(fd, &st, 1);
+	stats_stop(&st);
+
+	stats_print(&st, send_mode == MODE_COPY ? "write" :
+		    mode_names[send_mode]);
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_storage dest_addr;
+	int addr_family = AF_INET;
+	uint16_t port = 6666;
+	int c, longindex = 0;
+
+	memset(&dest_addr, 0, sizeof(dest_addr));
+
+	/* Parse commands line args */
+	while ((c = getopt_long(argc, argv, "hs46p:R:S:b:B:M:d:v::",
+				long_options, &longindex)) != -1) {
+		if (c == 's') server_mode = 1;
+		if (c == '4') addr_family = AF_INET;
+		if (c == '6') addr_family = AF_INET6;
+		if (c == 'p') port        = atoi(optarg);
+		if (c == 'R') recv_mode   = parse_mode(optarg, 1);
+		if (c == 'S') send_mode   = parse_mode(optarg, 0);
+		if (c == 'b') buf_size    = atoi(optarg);
+		if (c == 'B') sock_buf    = atoi(optarg);
+		if (c == 'M') mss         = atoi(optarg);
+		if (c == 'd') duration    = atoi(optarg);
+		if (c == 'v') verbose     = optarg ? atoi(optarg) : 1;
+		if (c == 'h' || c == '?') return usage(argv);
+	}
+	if (recv_mode < 0 || send_mode < 0 || buf_size <= 0)
+		return usage(argv);
+
+	if (server_mode)
+		return run_server(addr_family, port);
+
+	if (optind >= argc) {
+		fprintf(stderr, "Expected dest IP-address (IPv6 or IPv4)"
+			" argument after options\n");
+		return usage(argv);
+	}
+	setup_sockaddr(addr_family, &dest_addr, argv[optind], port);
+	return run_client(&dest_addr);
+}
@@ -6,11 +6,20 @@
  * IPv6 UDP client that expects an echo reply of its own packet
  *  - Set socket options to "encourage" fragmentation
  *
+ * Option -c N turns it into a ping-like RTT client for UDP services
+ * (e.g. udp_echo), sending N sequence-numbered probes at a fixed
+ * rate (-r), with at most -w probes outstanding.  Replies are matched
+ * by sequence number, probes without reply within -T msec are counted
+ * as lost.  RTT is reported as a histogram with percentiles.
+ *  - Option -b busy-polls the socket (SO_BUSY_POLL + non-blocking spin)
+ *  - Option -k uses kernel RX timestamps (SO_TIMESTAMPNS), excluding
+ *    the wakeup and syscall latency of the client from the RTT
+ *
  * TODO:
- *  - Impl. recv message, but with a timeout option
  *  - Can we recv ICMP err messages?
  *  - Can we detect if GSO has been enabled? (this can be a problem with KVM)
  */
+#define _GNU_SOURCE /* needed for ppoll */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -20,12 +29,50 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 #include "global.h"
+#include "common.h"
 #include "common_socket.h"
 
 #define PORT 4040 /* Default port, change with option "-p" */
-static volatile int verbose = 2;
+
+/* Probe mode settings */
+static int probe_rate = 1000;	/* probes/sec */
+static int probe_window = 64;	/* max outstanding probes */
+static int probe_timeout = 1000; /* msec, before counted as lost */
+static int busy_poll = 0;	/* usec for SO_BUSY_POLL, spin on recv */
+static int rx_tstamp = 0;	/* use SO_TIMESTAMPNS kernel RX stamp */
+
+#define PROBE_MAGIC 0x50524f42 /* "PROB" */
+
+/* Payload header of each probe, echoed back unchanged */
+struct probe_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t tx_ns;
+};
+
+/* Outstanding probe, indexed by seq % window */
+struct probe_slot {
+	uint32_t seq;
+	int in_use;
+	uint64_t tx_ns;		/* CLOCK_MONOTONIC */
+	uint64_t tx_real_ns;	/* CLOCK_REALTIME, for kernel RX stamp */
+};
+
+struct probe_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t lost;		/* timeout expired */
+	uint64_t late;		/* reply after timeout, or duplicate */
+	uint64_t invalid;	/* not our probe, or size mismatch */
+	uint64_t errors;	/* socket errors, e.g. ICMP unreachable */
+	uint64_t stalls;	/* probes delayed, window full */
+	struct histogram rtt;
+};
 
 int send_packet(int sockfd, const struct sockaddr_storage *dest_addr,
 		char *buf_send, uint16_t pkt_size)
@@ -79,6 +126,215 @@ void validate_packet(int len_send, int len_recv, char* buf_send, char* buf_recv)
 	printf("OK: valid size\n");
 }
 
+static uint64_t gettime_real(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Kernel RX timestamp from SO_TIMESTAMPNS control message, or 0 */
+static uint64_t rx_tstamp_get(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timespec *ts;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			ts = (struct timespec *)CMSG_DATA(cmsg);
+			return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+		}
+	}
+	return 0;
+}
+
+/* Match reply to outstanding probe by sequence number */
+static void probe_reply(struct probe_slot *slots, struct probe_stats *st,
+			char *buf, int len, int pkt_size, uint64_t now,
+			uint64_t rx_real)
+{
+	struct probe_hdr *hdr = (struct probe_hdr *)buf;
+	struct probe_slot *slot;
+	uint64_t rtt;
+
+	if (len != pkt_size || hdr->magic != PROBE_MAGIC) {
+		st->invalid++;
+		return;
+	}
+	slot = &slots[hdr->seq % probe_window];
+	if (!slot->in_use || slot->seq != hdr->seq) {
+		st->late++;
+		return;
+	}
+	if (rx_real)
+		rtt = rx_real - slot->tx_real_ns;
+	else
+		rtt = now - slot->tx_ns;
+	histogram_add(&st->rtt, rtt);
+	slot->in_use = 0;
+	st->received++;
+	if (verbose > 2)
+		printf("seq:%u rtt:%lu ns\n", hdr->seq, rtt);
+}
+
+/* Read all queued replies, without blocking */
+static void probe_recv_all(int sockfd, struct probe_slot *slots,
+			   struct probe_stats *st, char *buf, int pkt_size)
+{
+	char cbuf[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr msg;
+	struct iovec iov;
+	int len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = buf;
+
+	while (1) {
+		iov.iov_len = pkt_size + 1; /* detect oversized replies */
+		msg.msg_control = rx_tstamp ? cbuf : NULL;
+		msg.msg_controllen = rx_tstamp ? sizeof(cbuf) : 0;
+		len = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			/* E.g. ECONNREFUSED from ICMP port unreachable */
+			st->errors++;
+			if (verbose > 1)
+				perror("recvmsg");
+			return;
+		}
+		probe_reply(slots, st, buf, len, pkt_size, gettime(),
+			    rx_tstamp ? rx_tstamp_get(&msg) : 0);
+	}
+}
+
+static int run_probes(int sockfd, int pkt_size, int count)
+{
+	uint64_t timeout_ns = probe_timeout * 1000000ULL;
+	uint64_t start, now, next_send, wait_ns, stop;
+	uint32_t seq = 0, oldest = 0, stalled = ~0U;
+	struct probe_slot *slots, *slot;
+	struct probe_hdr *hdr;
+	struct probe_stats st;
+	struct pollfd pfd;
+	struct timespec ts;
+	char *buf_send, *buf_recv;
+	double sec;
+	int one = 1;
+
+	if (pkt_size < (int)sizeof(*hdr)) {
+		fprintf(stderr, "ERROR: probe size min %lu bytes\n",
+			sizeof(*hdr));
+		return EXIT_FAIL_OPTION;
+	}
+	slots = calloc(probe_window, sizeof(*slots));
+	buf_send = malloc_payload_buffer(pkt_size);
+	buf_recv = malloc_payload_buffer(pkt_size + 1);
+	memset(&st, 0, sizeof(st));
+	histogram_init(&st.rtt);
+	hdr = (struct probe_hdr *)buf_send;
+	hdr->magic = PROBE_MAGIC;
+
+	if (busy_poll)
+		Setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL,
+			   &busy_poll, sizeof(busy_poll));
+	if (rx_tstamp)
+		Setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS,
+			   &one, sizeof(one));
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+
+	start = gettime();
+	next_send = start;
+	while (seq < count || oldest != seq) {
+		now = gettime();
+
+		/* Expire lost probes, oldest first */
+		for (; oldest != seq; oldest++) {
+			slot = &slots[oldest % probe_window];
+			if (!slot->in_use)
+				continue;
+			if (now - slot->tx_ns < timeout_ns)
+				break;
+			slot->in_use = 0;
+			st.lost++;
+			if (verbose > 2)
+				printf("seq:%u lost\n", slot->seq);
+		}
+
+		/* Send probes due, catching up if behind schedule */
+		while (seq < count && now >= next_send) {
+			slot = &slots[seq % probe_window];
+			if (slot->in_use) {
+				if (stalled != seq)
+					st.stalls++;
+				stalled = seq;
+				break;
+			}
+			hdr->seq = seq;
+			hdr->tx_ns = now;
+			slot->seq = seq;
+			slot->tx_ns = now;
+			if (rx_tstamp)
+				slot->tx_real_ns = gettime_real();
+			if (send(sockfd, buf_send, pkt_size, 0) < 0) {
+				st.errors++;
+				if (verbose > 1)
+					perror("send");
+			} else {
+				slot->in_use = 1;
+				st.sent++;
+			}
+			seq++;
+			next_send = start + seq * 1000000000ULL / probe_rate;
+			now = gettime();
+		}
+
+		/* Wait for replies, until next send or oldest timeout */
+		if (!busy_poll) {
+			slot = &slots[oldest % probe_window];
+			wait_ns = timeout_ns;
+			if (oldest != seq && slot->in_use)
+				wait_ns = slot->tx_ns + timeout_ns - now;
+			if (seq < count && next_send > now &&
+			    next_send - now < wait_ns)
+				wait_ns = next_send - now;
+			if (seq < count && now >= next_send)
+				wait_ns = 1000000; /* window full */
+			ts.tv_sec  = wait_ns / 1000000000ULL;
+			ts.tv_nsec = wait_ns % 1000000000ULL;
+			if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+				continue;
+		}
+		probe_recv_all(sockfd, slots, &st, buf_recv, pkt_size);
+	}
+	stop = gettime();
+	sec = (stop - start) / 1e9;
+
+	printf("Probes sent:%lu received:%lu lost:%lu (%.3f%%) late:%lu"
+	       " invalid:%lu errors:%lu\n", st.sent, st.received, st.lost,
+	       st.sent ? 100.0 * st.lost / st.sent : 0, st.late, st.invalid,
+	       st.errors);
+	printf(" - rate:%.0f probes/sec (target:%d) window:%d stalls:%lu"
+	       " size:%d%s%s\n", st.sent / sec, probe_rate, probe_window,
+	       st.stalls, pkt_size, busy_poll ? " busy-poll" : "",
+	       rx_tstamp ? " rx-tstamp" : "");
+	if (verbose > 2)
+		histogram_print(&st.rtt, "rtt", "ns");
+	else
+		histogram_print_summary(&st.rtt, "rtt", "ns");
+
+	free(slots);
+	free(buf_send);
+	free(buf_recv);
+	return st.received ? 0 : EXIT_FAIL_RECV;
+}
+
 int main(int argc, char *argv[])
 {
 	int sockfd;
@@ -89,17 +345,34 @@ int main(int argc, char *argv[])
 	char *dest_ip;
 	int len_send, len_recv;
 	char buf_send[65535], buf_recv[65535];
+	int count = 0; /* Single-shot, unless probe mode */
+	int size_set = 0;
 
 	/* Adding support for both IPv4 and IPv6 */
 	struct sockaddr_storage dest_addr; /* Can contain both sockaddr_in and sockaddr_in6 */
 	memset(&dest_addr, 0, sizeof(dest_addr));
 
-	while ((opt = getopt(argc, argv, "s:64v:p:")) != -1) {
-		if (opt == 's') pkt_size = atoi(optarg);
+	verbose = 2;
+	while ((opt = getopt(argc, argv, "s:64v:p:c:r:w:T:b:k")) != -1) {
+		if (opt == 's') {
+			pkt_size = atoi(optarg);
+			size_set = 1;
+		}
 		if (opt == '4') addr_family = AF_INET;
 		if (opt == '6') addr_family = AF_INET6;
 		if (opt == 'v') verbose = atoi(optarg);
 		if (opt == 'p') dest_port = atoi(optarg);
+		if (opt == 'c') count = atoi(optarg);
+		if (opt == 'r') probe_rate = atoi(optarg);
+		if (opt == 'w') probe_window = atoi(optarg);
+		if (opt == 'T') probe_timeout = atoi(optarg);
+		if (opt == 'b') busy_poll = atoi(optarg);
+		if (opt == 'k') rx_tstamp = 1;
+	}
+	if (count < 0 || probe_rate < 1 || probe_window < 1 ||
+	    probe_timeout < 1 || busy_poll < 0 || pkt_size > 65507) {
+		fprintf(stderr, "ERROR: invalid probe option\n");
+		exit(EXIT_FAIL_OPTION);
 	}
 	if (optind >= argc) {
 		fprintf(stderr, "Expected dest IP-address (IPv6 or IPv4) argument after options\n");
@@ -126,6 +399,12 @@ int main(int argc, char *argv[])
 	/* Connect to recv ICMP error messages */
 	Connect(sockfd, (struct sockaddr *)&dest_addr, sockaddr_len(&dest_addr));
 
+	if (count) {
+		if (!size_set)
+			pkt_size = 64;
+		return run_probes(sockfd, pkt_size, count);
+	}
+
 	len_send = send_packet(sockfd, &dest_addr, buf_send, pkt_size);
 	len_recv = recv_packet(sockfd, &dest_addr, buf_recv, len_send);
 	validate_packet(len_send, len_recv, buf_send, buf_recv);
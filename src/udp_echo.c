@@ -18,9 +18,19 @@
  * - This can be solved by using recvmsg()/sendmsg()
  * - And setting socket opt IP_PKTINFO to request this as ancillary info
  * - For IPv6 the socket opt is IPV6_RECVPKTINFO.
+ *
+ * For use as a high rate reflector (e.g. for udp_client_echo RTT
+ * probes), option -b N receives up to N packets per recvmmsg() call
+ * and echoes them with a single sendmmsg().  The msghdr of each
+ * message keeps its own ancillary data, thus the per packet source IP
+ * is preserved.  Option -t N runs N worker threads, each with its own
+ * SO_REUSEPORT socket.  Use -v 0 to disable per packet printing, and
+ * -s to print echoes/sec every second.
  */
+#define _GNU_SOURCE /* needed for recvmmsg/sendmmsg */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <linux/udp.h>
 #include <string.h>
@@ -28,12 +38,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
 
+#include "global.h"
+#include "common.h"
 #include "common_socket.h"
 
 #define PORT 4040 /* Default port, change with option "-l" */
 #define DEBUG 1
-static volatile int verbose = 1;
+#define FRAME_SZ 8192	/* Buffer for packet data */
+#define CBUF_SZ  512	/* Buffer for ancillary data */
+#define MAX_BATCH 1024
 
 #ifndef __USE_GNU
 /* IPv6 packet information - in cmsg_data[] */
@@ -114,26 +130,35 @@ void print_info(struct msghdr *my_hdr)
 	}
 }
 
-int main(int argc, char *argv[])
-{
+/* Per worker thread state */
+struct echo_thread {
+	pthread_t thread;
+	int id;
 	int fd;
-	struct sockaddr_storage addr, rem_addr; /* Can contain both sockaddr_in and sockaddr_in6 */
-	int res, on = 1;
-	struct msghdr msghdr;
-	struct iovec vec[1];
-	char cbuf[512];  /* Buffer for ancillary data */
-	char frame[8192];/* Buffer for packet data */
-	int c, count = 1000000;
-	uint16_t listen_port = PORT;
-	int addr_family = AF_INET6; /* Default address family */
+	int batch;
+	/* Stats, read by main thread for per second rates */
+	volatile uint64_t echoes;
+	uint64_t calls;
+	uint64_t first_ns;
+	uint64_t last_ns;
+	volatile int done;
+};
 
-	while ((c = getopt(argc, argv, "c:l:64v:")) != -1) {
-		if (c == 'c') count = atoi(optarg);
-		if (c == 'l') listen_port  = atoi(optarg);
-		if (c == '4') addr_family = AF_INET;
-		if (c == '6') addr_family = AF_INET6;
-		if (c == 'v') verbose = atoi(optarg);
-	}
+/* The kernel spreads flows, not packets, across the reuseport group,
+ * thus -c is a global budget: the worker whose echoes make the total
+ * reach it stops all workers.
+ */
+static volatile int echo_stop;
+static uint64_t total_echoes;	/* atomic, across threads */
+static uint64_t echo_count;	/* stop after count echoes, 0 = forever */
+static uint64_t stop_ns;
+
+static int echo_setup_socket(int addr_family, uint16_t listen_port,
+			     int reuseport)
+{
+	struct sockaddr_storage addr; /* Can contain both sockaddr_in and sockaddr_in6 */
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+	int fd, on = 1;
 
 	fd = Socket(addr_family, SOCK_DGRAM, 0);
 
@@ -151,28 +176,70 @@ int main(int argc, char *argv[])
 		// inet_pton( AF_INET6, "::", (void *)&addr6->sin6_addr.s6_addr);
 	}
 
+	/* Each worker thread gets its own socket, kernel spread flows */
+	if (reuseport)
+		Setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
 	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
 		perror("bind");
-		return 1;
+		exit(EXIT_FAIL_SOCK);
 	}
 
+	/* Timeout blocking recv, to notice echo_stop set by other threads */
+	Setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
 	/* Socket options to get data on local destination IP */
 	setsockopt(fd, SOL_IP, IP_PKTINFO, &on, sizeof(on)); /* man ip(7) */
 	setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)); /* man ipv6(7)*/
 
-	while (1) {
-		memset(&msghdr, 0, sizeof(msghdr));
-		msghdr.msg_control = cbuf;
+	return fd;
+}
+
+static void echo_stats_update(struct echo_thread *t, int n)
+{
+	uint64_t total;
+
+	t->last_ns = gettime();
+	if (!t->first_ns)
+		t->first_ns = t->last_ns;
+	t->echoes += n;
+	t->calls++;
+
+	total = __sync_add_and_fetch(&total_echoes, n);
+	if (echo_count && total >= echo_count && total - n < echo_count) {
+		stop_ns = t->last_ns;
+		echo_stop = 1;
+	}
+}
+
+/* One packet per recvmsg()/sendmsg() pair */
+static void echo_single(struct echo_thread *t)
+{
+	struct sockaddr_storage rem_addr;
+	struct msghdr msghdr;
+	struct iovec vec[1];
+	char cbuf[CBUF_SZ];
+	char frame[FRAME_SZ];
+	int res;
+
+	/* Setup once, only fields updated by recv/send are reset */
+	memset(&msghdr, 0, sizeof(msghdr));
+	msghdr.msg_control = cbuf;
+	msghdr.msg_iov = vec;
+	msghdr.msg_iovlen = 1;
+	vec[0].iov_base = frame;
+	msghdr.msg_name = &rem_addr; /* Remote addr, updated on recv, used on send */
+
+	while (!echo_stop) {
 		msghdr.msg_controllen = sizeof(cbuf);
-		msghdr.msg_iov = vec;
-		msghdr.msg_iovlen = 1;
-		vec[0].iov_base = frame;
-		vec[0].iov_len = sizeof(frame);
-		msghdr.msg_name = &rem_addr; /* Remote addr, updated on recv, used on send */
 		msghdr.msg_namelen = sizeof(rem_addr);
-		res = recvmsg(fd, &msghdr, 0);
-		if (res == -1)
+		vec[0].iov_len = sizeof(frame);
+		res = recvmsg(t->fd, &msghdr, 0);
+		if (res == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
 			break;
+		}
 
 		if (verbose > 0) {
 			print_info(&msghdr);
@@ -184,9 +251,195 @@ int main(int argc, char *argv[])
 		 * (destination address of the incoming packet)
 		 */
 		vec[0].iov_len = res;
-		sendmsg(fd, &msghdr, 0);
-		if (--count == 0)
+		sendmsg(t->fd, &msghdr, 0);
+		echo_stats_update(t, 1);
+	}
+}
+
+/* Batch of packets per recvmmsg(), echoed by a single sendmmsg() */
+static void echo_batch(struct echo_thread *t)
+{
+	struct sockaddr_storage *rem_addrs;
+	struct mmsghdr *msgs;
+	struct iovec *vecs;
+	char *cbufs, *frames;
+	int i, n, res, sent;
+
+	msgs      = calloc(t->batch, sizeof(*msgs));
+	vecs      = calloc(t->batch, sizeof(*vecs));
+	rem_addrs = calloc(t->batch, sizeof(*rem_addrs));
+	cbufs     = malloc(t->batch * CBUF_SZ);
+	frames    = malloc(t->batch * FRAME_SZ);
+	if (!msgs || !vecs || !rem_addrs || !cbufs || !frames) {
+		fprintf(stderr, "ERROR: thread %d alloc batch %d failed\n",
+			t->id, t->batch);
+		exit(EXIT_FAIL_MEM);
+	}
+	for (i = 0; i < t->batch; i++) {
+		vecs[i].iov_base = frames + i * FRAME_SZ;
+		msgs[i].msg_hdr.msg_iov = &vecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &rem_addrs[i];
+		msgs[i].msg_hdr.msg_control = cbufs + i * CBUF_SZ;
+	}
+
+	while (!echo_stop) {
+		/* Only reset what the previous recv/send round changed */
+		for (i = 0; i < t->batch; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(rem_addrs[i]);
+			msgs[i].msg_hdr.msg_controllen = CBUF_SZ;
+			vecs[i].iov_len = FRAME_SZ;
+		}
+		/* Block for first packet, then take what is queued */
+		n = recvmmsg(t->fd, msgs, t->batch, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
 			break;
+		}
+
+		/* Echo each message with its own remote addr and
+		 * IP_PKTINFO, as returned in the per message control
+		 * buffer (msg_controllen updated by recvmmsg).
+		 */
+		for (i = 0; i < n; i++) {
+			vecs[i].iov_len = msgs[i].msg_len;
+			if (verbose > 0) {
+				print_info(&msgs[i].msg_hdr);
+				printf(" Echo back packet, size=%d\n",
+				       msgs[i].msg_len);
+			}
+		}
+		for (sent = 0; sent < n; sent += res) {
+			res = sendmmsg(t->fd, msgs + sent, n - sent, 0);
+			if (res <= 0) {
+				/* Drop rest, like failing sendmsg() */
+				if (verbose > 0)
+					perror("sendmmsg");
+				break;
+			}
+		}
+		echo_stats_update(t, n);
+	}
+	free(msgs);
+	free(vecs);
+	free(rem_addrs);
+	free(cbufs);
+	free(frames);
+}
+
+static void *echo_thread_run(void *arg)
+{
+	struct echo_thread *t = arg;
+
+	if (t->batch > 1)
+		echo_batch(t);
+	else
+		echo_single(t);
+	t->done = 1;
+	return NULL;
+}
+
+static void print_echo_stats(struct echo_thread *threads, int nr_threads)
+{
+	uint64_t echoes = 0, calls = 0, first = 0, last = 0;
+	double sec;
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct echo_thread *t = &threads[i];
+
+		echoes += t->echoes;
+		calls  += t->calls;
+		if (t->first_ns && (!first || t->first_ns < first))
+			first = t->first_ns;
+		if (t->last_ns > last)
+			last = t->last_ns;
+		if (nr_threads > 1)
+			printf(" thread %d: echoes:%lu\n", i, t->echoes);
+	}
+	/* Measure until the echo reaching -c, not to stragglers after */
+	if (stop_ns)
+		last = stop_ns;
+	sec = (last - first) / 1e9;
+	printf("Total echoes:%lu in %.3f sec = %.0f echoes/sec"
+	       " (threads:%d batch:%d avg:%.1f pkts/call)\n",
+	       echoes, sec, sec > 0 ? echoes / sec : 0, nr_threads,
+	       threads[0].batch, calls ? (double)echoes / calls : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct echo_thread *threads;
+	int c, count = 1000000;
+	uint16_t listen_port = PORT;
+	int addr_family = AF_INET6; /* Default address family */
+	int batch = 1, nr_threads = 1;
+	uint64_t echoes, last = 0, now;
+	int i, running, per_sec = 0;
+
+	verbose = 1;
+	while ((c = getopt(argc, argv, "c:l:64v:b:t:s")) != -1) {
+		if (c == 'c') count = atoi(optarg);
+		if (c == 'l') listen_port  = atoi(optarg);
+		if (c == '4') addr_family = AF_INET;
+		if (c == '6') addr_family = AF_INET6;
+		if (c == 'v') verbose = atoi(optarg);
+		if (c == 'b') batch = atoi(optarg);
+		if (c == 't') nr_threads = atoi(optarg);
+		if (c == 's') per_sec = 1;
+	}
+	if (batch < 1 || batch > MAX_BATCH || nr_threads < 1) {
+		fprintf(stderr, "ERROR: -b batch (1-%d) -t threads (>0)\n",
+			MAX_BATCH);
+		return EXIT_FAIL_OPTION;
+	}
+
+	echo_count = count > 0 ? count : 0;
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return EXIT_FAIL_MEM;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct echo_thread *t = &threads[i];
+
+		t->id = i;
+		t->batch = batch;
+		t->fd = echo_setup_socket(addr_family, listen_port,
+					  nr_threads > 1);
+	}
+	/* Start threads after all sockets are in the reuseport group */
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL,
+				   echo_thread_run, &threads[i])) {
+			fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+			return EXIT_FAIL_PTHREAD;
+		}
+	}
+
+	/* Wait for workers, optionally print per second echo rate */
+	now = gettime();
+	do {
+		usleep(100000);
+		running = 0;
+		echoes = 0;
+		for (i = 0; i < nr_threads; i++) {
+			running += !threads[i].done;
+			echoes  += threads[i].echoes;
+		}
+		if (per_sec && gettime() - now >= 1000000000ULL) {
+			printf("echoes/sec: %lu\n", echoes - last);
+			fflush(stdout);
+			last = echoes;
+			now += 1000000000ULL;
+		}
+	} while (running);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		close(threads[i].fd);
 	}
+	print_echo_stats(threads, nr_threads);
+	free(threads);
 	return 0;
 }
@@ -39,6 +39,23 @@ static const char *__doc__=
 #define RUN_WRITE     0x8
 #define RUN_SEND      0x10
 #define RUN_ALL       (RUN_SENDMSG | RUN_SENDMMSG | RUN_SENDTO | RUN_WRITE | RUN_SEND)
+/* Not part of RUN_ALL, as it requires an unconnected socket */
+#define RUN_SENDMMSG_FLOWS 0x20
+/* Not part of RUN_ALL, socket per source port */
+#define RUN_SENDMMSG_SPORTS 0x40
+
+/* Token bucket for rate limiting, refilled from CLOCK_MONOTONIC */
+struct token_bucket {
+	double rate;	   /* packets per nanosec */
+	double tokens;
+	double depth;	   /* bucket size in packets */
+	uint64_t last;	   /* time of last refill (ns) */
+	uint64_t start;
+	uint64_t sent;
+	/* Stats */
+	uint64_t spins;	   /* busy-poll loops waiting for tokens */
+	double overshoot;  /* max pkts ahead of schedule, at send return */
+};
 
 struct flood_params {
 	struct params_common c;
@@ -51,6 +68,21 @@ struct flood_params {
 
 	/* Support for both IPv4 and IPv6 */
 	struct sockaddr_storage dest_addr;
+
+	/* Many-flows: dest IP and port ranges rotated per message */
+	struct sockaddr_storage dest_addr_max;
+	uint16_t dest_port_max;
+	int flowlen;
+
+	/* Source ports: connected socket per port, rotated per sendmmsg */
+	uint16_t src_port;
+	int nr_src_ports;
+	int *src_fds;
+
+	/* Rate limiting, zero means flat out */
+	double rate_pps;
+	uint64_t bitrate;
+	struct token_bucket tb;
 };
 
 static const struct option long_options[] = {
@@ -65,11 +97,20 @@ static const struct option long_options[] = {
 	{"sendto",	no_argument,		NULL, 't' },
 	{"write",	no_argument,		NULL, 'T' },
 	{"send",	no_argument,		NULL, 'S' },
+	{"many-flows",	no_argument,		NULL, 'F' },
 	{"batch",	required_argument,	NULL, 'b' },
 	{"count",	required_argument,	NULL, 'c' },
 	{"port",	required_argument,	NULL, 'p' },
 	{"payload",	required_argument,	NULL, 'm' },
 	{"pmtu",	required_argument,	NULL, 'd' },// IP_MTU_DISCOVER
+	{"unconnected",	no_argument,		NULL, 'n' },
+	{"dst-ip-max",	required_argument,	NULL, 0 },
+	{"dst-port-max",required_argument,	NULL, 0 },
+	{"flowlen",	required_argument,	NULL, 0 },
+	{"src-ports",	required_argument,	NULL, 0 },
+	{"src-port",	required_argument,	NULL, 0 },
+	{"rate",	required_argument,	NULL, 'R' },
+	{"bitrate",	required_argument,	NULL, 0 },
 	{"verbose",	optional_argument,	NULL, 'v' },
 	{0, 0, NULL,  0 }
 };
@@ -136,6 +177,26 @@ static int usage(char *argv[])
 	printf("     -u -U -t -T -S: run any combination of"
 		       " sendmsg/sendmmsg/sendto/write/send\n");
 	printf("\n");
+	printf("Option --many-flows (-F) sends with sendmmsg on an unconnected\n"
+	       " socket, rotating dest IP-addr between IPADDR and --dst-ip-max\n"
+	       " and dest port between --port and --dst-port-max, changing\n"
+	       " flow every --flowlen packets (default 1).\n"
+	       " Compare against '-U --unconnected' and '-U' to see the cost\n"
+	       " of route lookups for unconnected and many-flow sends.\n");
+	printf("\n");
+	printf("Option --src-ports N creates N sockets bound to source port\n"
+	       " --src-port (default 20000) .. +N-1 and connected to dest,\n"
+	       " sending each sendmmsg (--batch pkts) from the next socket.\n"
+	       " Pair with 'udp_sink --conn-socks N' to test UDP socket\n"
+	       " lookup with many connected sockets sharing a port.\n");
+	printf("\n");
+	printf("Option --rate PPS or --bitrate BPS paces the sendmmsg tests\n"
+	       " via a token bucket (depth --batch packets), busy-polling\n"
+	       " CLOCK_MONOTONIC between batches.  The bitrate includes\n"
+	       " UDP/IP/Ethernet headers and CRC.  Reports achieved rate,\n"
+	       " rate error and max burst overshoot (pkts sent ahead of\n"
+	       " rate * elapsed time, when sendmmsg returns).\n");
+	printf("\n");
 	printf("Option --pmtu <N>  for Path MTU discover socket option"
 	       " IP_MTU_DISCOVER\n"
 	       " This affects the DF(Don't-Fragment) bit setting.\n"
@@ -171,6 +232,57 @@ static void fill_buf(const struct flood_params *p, char *buf, int len)
 	}
 }
 
+static void tb_init(struct token_bucket *tb, double rate_pps, int depth)
+{
+	memset(tb, 0, sizeof(*tb));
+	tb->rate   = rate_pps / NANOSEC_PER_SEC;
+	tb->depth  = depth;
+	tb->tokens = depth;
+	tb->start  = gettime();
+	tb->last   = tb->start;
+}
+
+/* Busy-poll until bucket contains tokens for n packets */
+static inline void tb_wait(struct token_bucket *tb, int n)
+{
+	uint64_t now;
+
+	if (!tb->rate)
+		return;
+
+	for (;;) {
+		now = gettime();
+		tb->tokens += (now - tb->last) * tb->rate;
+		tb->last = now;
+		if (tb->tokens > tb->depth)
+			tb->tokens = tb->depth;
+		if (tb->tokens >= n)
+			break;
+		tb->spins++;
+	}
+	tb->tokens -= n;
+}
+
+/* Account res sent packets out of n tokens taken by tb_wait(), and
+ * refund the tokens of a partial send.  Overshoot is measured against
+ * the clock after the send returned, not the bucket state, as how far
+ * ahead of the ideal schedule (rate * elapsed time) the sender got.
+ */
+static inline void tb_sent(struct token_bucket *tb, int n, int res)
+{
+	double ahead;
+
+	if (!tb->rate)
+		return;
+
+	if (res < n)
+		tb->tokens += n - res;
+	tb->sent += res;
+	ahead = tb->sent - (gettime() - tb->start) * tb->rate;
+	if (ahead > tb->overshoot)
+		tb->overshoot = ahead;
+}
+
 static int flood_with_sendto(int sockfd, struct flood_params *p,
 			     struct time_bench_record *r)
 {
@@ -421,6 +533,8 @@ static int flood_with_sendMmsg(int sockfd, struct flood_params *p,
 
 	/* Flood loop */
 	for (cnt = 0; cnt < batches; cnt++) {
+		/* Pace before stamping, sink latency excludes the wait */
+		tb_wait(&p->tb, p->batch);
 		if (p->pktgen_hdr)
 			for (pkt = 0; pkt < p->batch; pkt++)
 				fill_buf(p, msg_buf + pkt * p->msg_sz, p->msg_sz);
@@ -429,17 +543,20 @@ static int flood_with_sendMmsg(int sockfd, struct flood_params *p,
 
 		if (res < 0)
 			goto error;
+		tb_sent(&p->tb, p->batch, res);
 		total += res * p->msg_sz;
 	}
 	r->bytes = total;
 
 	if (last) {
+		tb_wait(&p->tb, last);
 		if (p->pktgen_hdr)
 			for (pkt = 0; pkt < p->batch; pkt++)
 				fill_buf(p, msg_buf + pkt * p->msg_sz, p->msg_sz);
 		res = syscall(__NR_sendmmsg, sockfd, mmsg_hdr, last, 0);
 		if (res < 0)
 			goto error;
+		tb_sent(&p->tb, last, res);
 	}
 
 	res = p->count;
@@ -456,6 +573,219 @@ out:
 }
 
 
+/* Advance sockaddr to next flow within the configured dest IP and
+ * port ranges.  Port is the inner loop, IP-addr the outer loop.
+ * For IPv6 only the lowest 32 bits of the address are rotated.
+ */
+static void flow_next(struct sockaddr_storage *addr,
+		      const struct flood_params *p)
+{
+	uint16_t port_min, port, port_max = p->dest_port_max;
+	uint32_t ip, ip_min, ip_max;
+	uint32_t *ip_ptr;
+
+	if (addr->ss_family == AF_INET6) {
+		struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)addr;
+
+		ip_ptr   = &a6->sin6_addr.s6_addr32[3];
+		port     = ntohs(a6->sin6_port);
+		port_min = ntohs(((struct sockaddr_in6 *)&p->dest_addr)->sin6_port);
+		ip_min   = ((struct sockaddr_in6 *)&p->dest_addr)->sin6_addr.s6_addr32[3];
+		ip_max   = ((struct sockaddr_in6 *)&p->dest_addr_max)->sin6_addr.s6_addr32[3];
+	} else {
+		struct sockaddr_in *a4 = (struct sockaddr_in *)addr;
+
+		ip_ptr   = &a4->sin_addr.s_addr;
+		port     = ntohs(a4->sin_port);
+		port_min = ntohs(((struct sockaddr_in *)&p->dest_addr)->sin_port);
+		ip_min   = ((struct sockaddr_in *)&p->dest_addr)->sin_addr.s_addr;
+		ip_max   = ((struct sockaddr_in *)&p->dest_addr_max)->sin_addr.s_addr;
+	}
+	ip     = ntohl(*ip_ptr);
+	ip_min = ntohl(ip_min);
+	ip_max = ntohl(ip_max);
+
+	if (port < port_max) {
+		port++;
+	} else {
+		port = port_min;
+		ip = (ip < ip_max) ? ip + 1 : ip_min;
+	}
+	*ip_ptr = htonl(ip);
+
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+/* Like flood_with_sendMmsg, but every mmsghdr gets its own dest addr,
+ * rotated through the configured flow ranges.  Intended for an
+ * unconnected socket, thus each message cause a route lookup, and on
+ * the receiver side stress conntrack and RSS spreading (like
+ * pktgen_sample04_many_flows.sh).
+ */
+static int flood_with_sendMmsg_flows(int sockfd, struct flood_params *p,
+				     struct time_bench_record *r)
+{
+	int total_size = p->batch * p->msg_sz; /* total amount to be allocated */
+	char          *msg_buf;  /* payload data */
+	struct iovec  *msg_iov;  /* io-vector: array of pointers to payload data */
+	struct sockaddr_storage *dest; /* per message dest addr */
+	struct sockaddr_storage flow;  /* current flow */
+	socklen_t addrlen = sockaddr_len(&p->dest_addr);
+	struct mmsghdr *mmsg_hdr;
+	uint64_t total = 0, flow_pkts = 0;
+	int cnt, res = 0, pkt, len;
+
+	msg_buf  = malloc_payload_buffer(total_size); /* Alloc payload buffer */
+	mmsg_hdr = malloc_mmsghdr(p->batch);         /* Alloc mmsghdr array */
+	msg_iov  = malloc_iovec(p->batch);           /* Alloc I/O vector array */
+	dest     = calloc(p->batch, sizeof(*dest));
+	if (!dest) {
+		fprintf(stderr, "ERROR: %s() failed in calloc()\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+
+	/*** Setup packet structure for transmitting ***/
+	for (pkt = 0; pkt < p->batch; pkt++) {
+		msg_iov[pkt].iov_base = msg_buf + pkt * p->msg_sz;
+		msg_iov[pkt].iov_len  = p->msg_sz;
+
+		mmsg_hdr[pkt].msg_hdr.msg_name    = &dest[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_namelen = addrlen;
+		mmsg_hdr[pkt].msg_hdr.msg_iov     = &msg_iov[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_iovlen  = 1;
+	}
+	flow = p->dest_addr;
+
+	/* Flood loop */
+	for (cnt = 0; cnt < p->count; cnt += res) {
+		len = p->count - cnt;
+		if (len > p->batch)
+			len = p->batch;
+
+		tb_wait(&p->tb, len);
+		/* Rotate dest addr, changing flow every flowlen packets */
+		for (pkt = 0; pkt < len; pkt++) {
+			if (flow_pkts++ == p->flowlen) {
+				flow_next(&flow, p);
+				flow_pkts = 1;
+			}
+			dest[pkt] = flow;
+			fill_buf(p, msg_buf + pkt * p->msg_sz, p->msg_sz);
+		}
+		res = syscall(__NR_sendmmsg, sockfd, mmsg_hdr, len, 0);
+		if (res <= 0)
+			goto error;
+		tb_sent(&p->tb, len, res);
+		total += res * p->msg_sz;
+	}
+	r->bytes = total;
+	res = cnt;
+	goto out;
+error:
+	/* Error case */
+	fprintf(stderr, "Managed to send %d packets\n", cnt);
+	perror("- sendMmsg");
+	res = -1;
+out:
+	free(dest);
+	free(msg_iov);
+	free(mmsg_hdr);
+	free(msg_buf);
+	return res;
+}
+
+/* Like flood_with_sendMmsg, but rotate over the source port sockets,
+ * one sendmmsg per socket.  At the receiver each batch hit a
+ * different 4-tuple.
+ */
+static int flood_with_sendMmsg_sports(int sockfd, struct flood_params *p,
+				      struct time_bench_record *r)
+{
+	int total_size = p->batch * p->msg_sz; /* total amount to be allocated */
+	char          *msg_buf;  /* payload data */
+	struct iovec  *msg_iov;  /* io-vector: array of pointers to payload data */
+	struct mmsghdr *mmsg_hdr;
+	uint64_t total = 0;
+	int cnt, res = 0, pkt, len, idx = 0;
+
+	msg_buf  = malloc_payload_buffer(total_size); /* Alloc payload buffer */
+	mmsg_hdr = malloc_mmsghdr(p->batch);         /* Alloc mmsghdr array */
+	msg_iov  = malloc_iovec(p->batch);           /* Alloc I/O vector array */
+
+	for (pkt = 0; pkt < p->batch; pkt++) {
+		msg_iov[pkt].iov_base = msg_buf + pkt * p->msg_sz;
+		msg_iov[pkt].iov_len  = p->msg_sz;
+		mmsg_hdr[pkt].msg_hdr.msg_iov    = &msg_iov[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* Flood loop */
+	for (cnt = 0; cnt < p->count; cnt += res) {
+		len = p->count - cnt;
+		if (len > p->batch)
+			len = p->batch;
+
+		tb_wait(&p->tb, len);
+		if (p->pktgen_hdr)
+			for (pkt = 0; pkt < len; pkt++)
+				fill_buf(p, msg_buf + pkt * p->msg_sz, p->msg_sz);
+		res = syscall(__NR_sendmmsg, p->src_fds[idx], mmsg_hdr, len, 0);
+		if (res <= 0)
+			goto error;
+		tb_sent(&p->tb, len, res);
+		total += res * p->msg_sz;
+		if (++idx == p->nr_src_ports)
+			idx = 0;
+	}
+	r->bytes = total;
+	res = cnt;
+	goto out;
+error:
+	/* Error case */
+	fprintf(stderr, "Managed to send %d packets (src port %d)\n", cnt,
+		p->src_port + idx);
+	perror("- sendMmsg");
+	res = -1;
+out:
+	free(msg_iov);
+	free(mmsg_hdr);
+	free(msg_buf);
+	return res;
+}
+
+/* Socket per source port, all connected to dest_addr */
+static void setup_src_ports(struct flood_params *p, int addr_family)
+{
+	struct sockaddr_storage src;
+	int i;
+
+	p->src_fds = calloc(p->nr_src_ports, sizeof(*p->src_fds));
+	if (!p->src_fds) {
+		fprintf(stderr, "ERROR: %s() failed in calloc()\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	raise_nofile_limit(p->nr_src_ports + 64);
+
+	for (i = 0; i < p->nr_src_ports; i++) {
+		p->src_fds[i] = Socket(addr_family, SOCK_DGRAM,
+				       p->lite ? IPPROTO_UDPLITE : IPPROTO_UDP);
+		memset(&src, 0, sizeof(src));
+		src.ss_family = addr_family;
+		if (addr_family == AF_INET6)
+			((struct sockaddr_in6 *)&src)->sin6_port =
+				htons(p->src_port + i);
+		else
+			((struct sockaddr_in *)&src)->sin_port =
+				htons(p->src_port + i);
+		Bind(p->src_fds[i], &src);
+		Connect(p->src_fds[i], (struct sockaddr *)&p->dest_addr,
+			sockaddr_len(&p->dest_addr));
+	}
+}
+
 static void time_function(int sockfd, struct flood_params *p,
 			  int (*func)(int sockfd, struct flood_params *p,
 				      struct time_bench_record *r))
@@ -463,6 +793,7 @@ static void time_function(int sockfd, struct flood_params *p,
 	struct time_bench_record rec = {0};
 	int cnt_send;
 
+	tb_init(&p->tb, p->rate_pps, p->batch);
 	time_bench_start(&rec);
 	cnt_send = func(sockfd, p, &rec);
 	time_bench_stop(&rec);
@@ -475,6 +806,14 @@ static void time_function(int sockfd, struct flood_params *p,
 	rec.packets = cnt_send;
 	time_bench_calc_stats(&rec);
 	time_bench_print_stats(&rec, &p->c);
+
+	/* Only some send functions are rate limited */
+	if (p->tb.sent)
+		printf(" - rate: target %.0f pps achieved %.0f pps"
+		       " error %+.3f%% overshoot %.1f pkts (spins:%lu)\n",
+		       p->rate_pps, rec.pps,
+		       (rec.pps - p->rate_pps) * 100 / p->rate_pps,
+		       p->tb.overshoot, p->tb.spins);
 }
 
 static void init_params(struct flood_params *params)
@@ -484,6 +823,8 @@ static void init_params(struct flood_params *params)
 	params->batch = 32;
 	params->msg_sz = 18; /* 18 +14(eth)+8(UDP)+20(IP)+4(Eth-CRC) = 64 bytes */
 	params->pmtu = -1;
+	params->flowlen = 1;
+	params->src_port = 20000;
 }
 
 int main(int argc, char *argv[])
@@ -497,12 +838,34 @@ int main(int argc, char *argv[])
 	char *dest_ip;
 	int run_flag = 0;
 	int longindex = 0;
+	int unconnected = 0;
+	char *dest_ip_max = NULL;
 
 	init_params(&p);
 
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "hc:p:m:64PLv:tTuUb:",
+	while ((c = getopt_long(argc, argv, "hc:p:m:64PLv:tTuUSFnb:d:R:",
 				long_options, &longindex)) != -1) {
+		if (c == 0) {
+			/* handle options without short version */
+			if (!strcmp(long_options[longindex].name,
+				    "dst-ip-max"))
+				dest_ip_max = optarg;
+			if (!strcmp(long_options[longindex].name,
+				    "dst-port-max"))
+				p.dest_port_max = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "flowlen"))
+				p.flowlen = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "bitrate"))
+				p.bitrate = strtod(optarg, NULL);
+			if (!strcmp(long_options[longindex].name,
+				    "src-ports")) {
+				p.nr_src_ports = atoi(optarg);
+				run_flag |= RUN_SENDMMSG_SPORTS;
+			}
+			if (!strcmp(long_options[longindex].name, "src-port"))
+				p.src_port = atoi(optarg);
+		}
 		if (c == 'c') p.count     = atoi(optarg);
 		if (c == 'p') dest_port   = atoi(optarg);
 		if (c == 'm') p.msg_sz    = atoi(optarg);
@@ -518,6 +881,9 @@ int main(int argc, char *argv[])
 		if (c == 't') run_flag   |= RUN_SENDTO;
 		if (c == 'T') run_flag   |= RUN_WRITE;
 		if (c == 'S') run_flag   |= RUN_SEND;
+		if (c == 'F') run_flag   |= RUN_SENDMMSG_FLOWS;
+		if (c == 'n') unconnected = 1;
+		if (c == 'R') p.rate_pps  = strtod(optarg, NULL);
 		if (c == 'h' || c == '?') return usage(argv);
 	}
 	if (optind >= argc) {
@@ -528,6 +894,19 @@ int main(int argc, char *argv[])
 	if (verbose > 0)
 		printf("Destination IP:%s port:%d\n", dest_ip, dest_port);
 
+	/* Convert bitrate to packet rate, counting headers and CRC */
+	if (p.bitrate) {
+		int hdr_sz = 8 + 14 + 4 + (addr_family == AF_INET6 ? 40 : 20);
+
+		p.rate_pps = (double)p.bitrate / ((p.msg_sz + hdr_sz) * 8);
+	}
+
+	if ((run_flag & RUN_SENDMMSG_SPORTS) && p.nr_src_ports < 1)
+		return usage(argv);
+
+	/* Only the sendmmsg variants are paced */
+	if (run_flag == 0 && p.rate_pps)
+		run_flag = RUN_SENDMMSG;
 	if (run_flag == 0)
 		run_flag = RUN_ALL;
 
@@ -546,11 +925,36 @@ int main(int argc, char *argv[])
 	/* Setup dest_addr depending on IPv4 or IPv6 address */
 	setup_sockaddr(addr_family, &p.dest_addr, dest_ip, dest_port);
 
+	/* Flow ranges default to a single flow (the dest_addr) */
+	if (dest_ip_max)
+		setup_sockaddr(addr_family, &p.dest_addr_max, dest_ip_max,
+			       dest_port);
+	else
+		p.dest_addr_max = p.dest_addr;
+	if (p.dest_port_max < dest_port)
+		p.dest_port_max = dest_port;
+	if (p.flowlen < 1)
+		p.flowlen = 1;
+
+	/* Many-flows needs per message dest addr, thus unconnected */
+	if (run_flag & RUN_SENDMMSG_FLOWS)
+		unconnected = 1;
+
+	/* send() and write() require a connected socket */
+	if (unconnected && (run_flag & (RUN_SEND | RUN_WRITE))) {
+		if (verbose > 0)
+			printf("Skip send/write tests on unconnected socket\n");
+		run_flag &= ~(RUN_SEND | RUN_WRITE);
+	}
+
 	/* Connect to recv ICMP error messages, and to avoid the
 	 * kernel performing connect/unconnect cycles
 	 */
-	Connect(sockfd, (struct sockaddr *)&p.dest_addr, sockaddr_len(&p.dest_addr));
-	p.c.connect = 1;
+	if (!unconnected) {
+		Connect(sockfd, (struct sockaddr *)&p.dest_addr,
+			sockaddr_len(&p.dest_addr));
+		p.c.connect = 1;
+	}
 
 	if (!verbose)
 		printf("%-14s\t packets \tns/pkt\tpps\t\tcycles\tpayload\n",
@@ -579,6 +983,26 @@ int main(int argc, char *argv[])
 		time_function(sockfd, &p, flood_with_write);
 	}
 
+	if (run_flag & RUN_SENDMMSG_SPORTS) {
+		setup_src_ports(&p, addr_family);
+		if (verbose > 0)
+			printf(" - source ports %u-%u\n", p.src_port,
+			       p.src_port + p.nr_src_ports - 1);
+		print_header("sportMmsg", p.batch);
+		time_function(sockfd, &p, flood_with_sendMmsg_sports);
+		for (c = 0; c < p.nr_src_ports; c++)
+			close(p.src_fds[c]);
+		free(p.src_fds);
+	}
+
+	if (run_flag & RUN_SENDMMSG_FLOWS) {
+		if (verbose > 0)
+			printf(" - flows: %u ports x IP-range, flowlen %d\n",
+			       p.dest_port_max - dest_port + 1, p.flowlen);
+		print_header("flowMmsg", p.batch);
+		time_function(sockfd, &p, flood_with_sendMmsg_flows);
+	}
+
 	close(sockfd);
 	return 0;
 }
@@ -3,7 +3,10 @@
  * License: GPLv2
  */
 static const char *__doc__=
- " This tool is a UDP pacer that clock-out packets at fixed interval.\n";
+ " This tool is a UDP pacer that clock-out packets at fixed interval.\n"
+ " Each interval a burst of --batch packets is sent with sendmmsg,\n"
+ " every packet carry its own sequence number, and the intended and\n"
+ " actual send time (see struct pacer_hdr).\n";
 
 #define _GNU_SOURCE /* needed for struct mmsghdr and getopt.h */
 #include <getopt.h>
@@ -25,6 +28,10 @@ static const char *__doc__=
 #include <time.h>
 #include <errno.h>
 #include <limits.h>
+#include <endian.h>
+
+#include <linux/net_tstamp.h> /* struct sock_txtime */
+#include <linux/errqueue.h>   /* struct sock_extended_err */
 
 #include "global.h"
 #include "common.h"
@@ -39,11 +46,62 @@ static const struct option long_options[] = {
 	{"priority",	required_argument,	NULL, 'P' },
 	{"interval",	required_argument,	NULL, 's' },
 	{"sleep_usec",	required_argument,	NULL, 's' },
+	{"txtime",	optional_argument,	NULL, 'T' },
+	{"txtime-delta",required_argument,	NULL, 0 },
+	{"txtime-gap",	required_argument,	NULL, 0 },
+	{"wakeup",	required_argument,	NULL, 'w' },
+	{"spin-margin",	required_argument,	NULL, 0 },
+	{"stream",	required_argument,	NULL, 'S' },
+	{"streams",	required_argument,	NULL, 'n' },
+	{"threads",	required_argument,	NULL, 't' },
+	{"cpu",		required_argument,	NULL, 0 },
+	{"tx-tstamp",	no_argument,		NULL, 0 },
 	{0, 0, NULL,  0 }
 };
 
+/* How the timer thread waits for the next period */
+enum wakeup_mode {
+	WAKEUP_SLEEP = 0, /* clock_nanosleep only */
+	WAKEUP_HYBRID,	  /* sleep until margin before deadline, then spin */
+	WAKEUP_SPIN,	  /* pure busy-poll on the clock */
+};
+
+static const char *wakeup_names[] = {
+	[WAKEUP_SLEEP]	= "sleep",
+	[WAKEUP_HYBRID]	= "hybrid",
+	[WAKEUP_SPIN]	= "spin",
+};
+
+/* Modes for SO_TXTIME, the qdisc decide which clock to use */
+enum txtime_mode {
+	TXTIME_OFF = 0,
+	TXTIME_ETF,	/* ETF qdisc: CLOCK_TAI */
+	TXTIME_FQ,	/* FQ qdisc:  CLOCK_MONOTONIC */
+};
+
+#ifndef SCM_TXTIME
+#define SO_TXTIME	61
+#define SCM_TXTIME	SO_TXTIME
+#endif
+
+/* SO_TIMESTAMPING TX: the kernel loops back a timestamp on the error
+ * queue at each layer.  OPT_ID tags it with a per socket counter of
+ * sent datagrams, TSONLY avoids looping back the payload.
+ */
+#define TX_TSTAMP_FLAGS (SOF_TIMESTAMPING_TX_SCHED	| \
+			 SOF_TIMESTAMPING_TX_SOFTWARE	| \
+			 SOF_TIMESTAMPING_TX_HARDWARE	| \
+			 SOF_TIMESTAMPING_SOFTWARE	| \
+			 SOF_TIMESTAMPING_RAW_HARDWARE	| \
+			 SOF_TIMESTAMPING_OPT_ID	| \
+			 SOF_TIMESTAMPING_OPT_TSONLY)
+
+/* Send times of the last packets, indexed by OPT_ID key */
+#define TX_TSTAMP_RING	4096
+
 /* Global variables */
 static int shutdown_global = 0;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Default interval in usec */
 #define DEFAULT_INTERVAL 1000000
@@ -61,42 +119,109 @@ struct cfg_params {
 	unsigned long interval;
 	int thread_prio;
 
+	/* SO_TXTIME: launch time is set per packet, qdisc does pacing */
+	int txtime;
+	unsigned long txtime_delta; /* usec: wakeup before launch time */
+	unsigned long txtime_gap;   /* nsec: spacing between burst pkts */
+
+	int wakeup;
+	unsigned long spin_margin;  /* usec: hybrid wakeup spin period */
+
+	/* Streams are sharded round-robin over threads */
+	struct stream *streams;
+	int nr_streams;
+	int threads;
+	int cpu;	    /* pin thread N to CPU (cpu + N), -1 no pinning */
+
+	int tx_tstamp;	    /* SO_TIMESTAMPING TX latency breakdown */
+
 	/* Below socket setup */
-	int sockfd;
 	int addr_family;    /* redundant: in dest_addr after setup_sockaddr */
 	uint16_t dest_port; /* redundant: in dest_addr after setup_sockaddr */
-	struct sockaddr_storage dest_addr; /* Support for both IPv4 and IPv6 */
 };
 
-/* Struct to transfer parameters to the thread */
-struct thread_param {
-	struct thread_stat *stats;
+/* Struct for per stream statistics */
+struct stream_stat {
+	unsigned long cycles;
+	unsigned long packets; /* also used as packet sequence */
+	unsigned long send_errors;
+
+	/* Lateness: wakeup error in nanosec */
+	struct histogram wakeup_err;
+
+	/* SO_TXTIME errors reported via MSG_ERRQUEUE */
+	unsigned long txtime_missed;
+	unsigned long txtime_invalid;
+
+	/* SO_TIMESTAMPING TX delays in nanosec */
+	struct histogram tx_sched;	/* sendmmsg to qdisc (sched) */
+	struct histogram tx_driver;	/* sched to driver (software) */
+	struct histogram tx_hw;		/* driver to NIC (hardware) */
+	unsigned long tx_tstamps;
+	unsigned long tx_unmatched;	/* key fell out of ring */
+};
 
+struct tx_tstamp_slot {
+	uint64_t user;	/* CLOCK_REALTIME before sendmmsg */
+	uint64_t sched;
+	uint64_t sw;
+};
+
+/* A periodic stream: a burst to one destination every interval */
+struct stream {
+	int id;
 	int sockfd;
+	int addr_family;
+	struct sockaddr_storage dest_addr;
+	unsigned long interval; /* usec */
 	int batch;
-	int msg_sz;
+	int prio;		/* SO_PRIORITY, and scheduler tie-break */
 
-	int clock;
-	unsigned long interval;
+	struct burst *burst;
+	struct timespec next;	/* launch time */
+	struct timespec wake;	/* next minus txtime_delta */
+	uint64_t wake_ns;	/* scheduler key */
 
-	/* Scheduling prio */
-	int prio;
-	int policy;
+	/* SO_TIMESTAMPING: ring indexed by OPT_ID key */
+	struct tx_tstamp_slot *tx_ring;
+	uint32_t tx_key;	/* key of next packet sent */
 
-	unsigned long max_cycles;
+	struct stream_stat stats;
 };
 
-/* Struct for statistics */
+/* Struct for per thread state */
 struct thread_stat {
 	pthread_t thread;
 	int thread_started;
+};
 
-	unsigned long cycles;
-	//unsigned long cyclesread;
-	long min;
-	long max;
-	long act;
-	double avg;
+/* Struct to transfer parameters to the thread */
+struct thread_param {
+	struct thread_stat *stats;
+	int id;
+	int cpu;
+
+	/* Streams handled by this thread */
+	struct stream **streams;
+	int nr_streams;
+	int msg_sz;
+
+	int clock;
+
+	int txtime;
+	unsigned long txtime_delta;
+	unsigned long txtime_gap;
+
+	int wakeup;
+	unsigned long spin_margin;
+
+	int tx_tstamp;
+
+	/* Scheduling prio */
+	int prio;
+	int policy;
+
+	unsigned long max_cycles; /* per stream */
 };
 
 static int usage(char *argv[])
@@ -104,7 +229,7 @@ static int usage(char *argv[])
 	int i;
 
 	printf("\nDOCUMENTATION:\n%s\n\n", __doc__);
-	printf(" Usage: %s (options-see-below) IPADDR\n", argv[0]);
+	printf(" Usage: %s (options-see-below) [IPADDR]\n", argv[0]);
 	printf(" Listing options:\n");
 	for (i = 0; long_options[i].name != 0; i++) {
 		printf(" --%-12s", long_options[i].name);
@@ -116,6 +241,38 @@ static int usage(char *argv[])
 			       long_options[i].val);
 		printf("\n");
 	}
+	printf("\n");
+	printf("Option --txtime[=etf|fq] stamps every packet with a SCM_TXTIME\n"
+	       " launch time, letting the ETF or FQ qdisc release the packet\n"
+	       " (use tc/tc_txtime_setup.sh).  The thread wakes up\n"
+	       " --txtime-delta usec before launch time, and burst packets\n"
+	       " are spaced --txtime-gap nsec apart.  Packets carry the\n"
+	       " launch time in the pktgen header, compare spacing against\n"
+	       " the sleep based mode at the receiver.\n");
+	printf("\n");
+	printf("Option --wakeup MODE selects how the thread waits for the\n"
+	       " next period, and the wakeup error histogram is printed:\n"
+	       "  sleep  : clock_nanosleep(TIMER_ABSTIME) (default)\n"
+	       "  hybrid : sleep until --spin-margin usec before deadline,\n"
+	       "           then busy-spin reading the clock\n"
+	       "  spin   : busy-spin the whole period (burns a CPU)\n");
+	printf("\n");
+	printf("Multiple streams, each with own destination and period:\n"
+	       " --stream IPADDR[,PORT[,INTERVAL[,BATCH[,PRIO]]]] (repeatable)\n"
+	       "   omitted fields use --port/--interval/--batch, PRIO sets\n"
+	       "   SO_PRIORITY and wins ties between equal deadlines.\n"
+	       " --streams N adds N streams to IPADDR, port + 0..N-1.\n"
+	       " Streams are driven by a min-heap scheduler per thread,\n"
+	       " --threads N shards streams round-robin over N threads,\n"
+	       " --cpu C pins thread N to CPU C+N.  --count is per stream.\n"
+	       " Per stream lateness (wakeup error) stats are printed.\n");
+	printf("\n");
+	printf("Option --tx-tstamp enables SO_TIMESTAMPING TX timestamps\n"
+	       " (SCHED, SOFTWARE and HARDWARE with OPT_ID), reaped from the\n"
+	       " socket error queue.  Histograms of sendmmsg-to-sched (time\n"
+	       " in stack before qdisc) and sched-to-driver (time in qdisc)\n"
+	       " are printed.  Hardware stamps need the NIC to be configured\n"
+	       " via SIOCSHWTSTAMP and the PHC synced to CLOCK_REALTIME.\n");
 	return EXIT_FAIL_OPTION;
 }
 
@@ -150,66 +307,381 @@ static inline int64_t calcdiff(struct timespec t1, struct timespec t2)
 	return diff;
 }
 
-static void fill_buf_pktgen(char *buf, int len,
-			    struct timespec *ts, uint32_t sequence)
+static inline uint64_t timespec_ns(struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline void timespec_sub_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec  -= ns / NSEC_PER_SEC;
+	ts->tv_nsec -= ns % NSEC_PER_SEC;
+	if (ts->tv_nsec < 0) {
+		ts->tv_nsec += NSEC_PER_SEC;
+		ts->tv_sec--;
+	}
+}
+
+/* Wait until absolute time "wake".  The spin part reads the clock via
+ * vDSO (TSC based on x86), which is cheap and avoids the wakeup
+ * latency of the scheduler/hrtimer path.  Returns clock_nanosleep()
+ * error, or EINTR when shutdown stopped the spin before the deadline.
+ */
+static int wait_until(int clock, int mode, struct timespec *wake,
+		      unsigned long spin_margin)
+{
+	struct timespec sleep_to = *wake, now;
+	uint64_t deadline = timespec_ns(wake);
+	int err;
+
+	if (mode != WAKEUP_SPIN) {
+		if (mode == WAKEUP_HYBRID)
+			timespec_sub_ns(&sleep_to, spin_margin * 1000);
+		err = clock_nanosleep(clock, TIMER_ABSTIME, &sleep_to, NULL);
+		if (err || mode == WAKEUP_SLEEP)
+			return err;
+	}
+
+	do {
+		if (shutdown_global)
+			return EINTR;
+		clock_gettime(clock, &now);
+	} while (timespec_ns(&now) < deadline);
+
+	return 0;
+}
+
+/* Prebuilt mmsghdr array for sending a burst with one sendmmsg.
+ * Each packet has its own payload buffer, and with txtime its own
+ * SCM_TXTIME control buffer.
+ */
+struct burst {
+	struct mmsghdr *mmsg;
+	struct iovec *iov;
+	char *payload;
+	char *control;
+	int len;
+	int msg_sz;
+};
+
+#define TXTIME_CMSG_SPACE CMSG_SPACE(sizeof(uint64_t))
+
+static struct burst *burst_alloc(int len, int msg_sz, int txtime)
 {
-	struct pktgen_hdr *hdr;
+	struct cmsghdr *cmsg;
+	struct burst *b;
+	int i;
 
-	if (sizeof(hdr) > len)
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		fprintf(stderr, "ERROR: %s() failed in calloc()\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	b->len     = len;
+	b->msg_sz  = msg_sz;
+	b->mmsg    = malloc_mmsghdr(len);
+	b->iov     = malloc_iovec(len);
+	b->payload = malloc_payload_buffer(len * msg_sz);
+	if (txtime)
+		b->control = malloc_payload_buffer(len * TXTIME_CMSG_SPACE);
+
+	for (i = 0; i < len; i++) {
+		struct msghdr *msg = &b->mmsg[i].msg_hdr;
+
+		b->iov[i].iov_base = b->payload + i * msg_sz;
+		b->iov[i].iov_len  = msg_sz;
+		msg->msg_iov    = &b->iov[i];
+		msg->msg_iovlen = 1;
+		if (!txtime)
+			continue;
+
+		msg->msg_control    = b->control + i * TXTIME_CMSG_SPACE;
+		msg->msg_controllen = TXTIME_CMSG_SPACE;
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_TXTIME;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+	}
+	return b;
+}
+
+static void burst_free(struct burst *b)
+{
+	free(b->control);
+	free(b->payload);
+	free(b->iov);
+	free(b->mmsg);
+	free(b);
+}
+
+/* Stamp every packet in burst with its own sequence number, and the
+ * intended (launch) and actual send time.  Packets are spaced gap
+ * nsec apart, which with txtime is also the SCM_TXTIME launch time.
+ */
+static void burst_fill(struct burst *b, uint32_t burst_seq, uint32_t seq,
+		       uint64_t intended, unsigned long gap, uint64_t actual)
+{
+	struct pacer_hdr *hdr;
+	int i;
+
+	for (i = 0; i < b->len; i++) {
+		uint64_t launch = intended + i * gap;
+		struct msghdr *msg = &b->mmsg[i].msg_hdr;
+
+		if (msg->msg_control)
+			memcpy(CMSG_DATA(CMSG_FIRSTHDR(msg)), &launch,
+			       sizeof(launch));
+
+		if (b->msg_sz < sizeof(*hdr))
+			continue;
+		hdr = (struct pacer_hdr *)b->iov[i].iov_base;
+		hdr->pgh.pgh_magic = htonl(PKTGEN_MAGIC);
+		hdr->pgh.seq_num   = htonl(seq + i);
+		hdr->pgh.tv_sec    = htonl(launch / NSEC_PER_SEC);
+		hdr->pgh.tv_usec   = htonl((launch % NSEC_PER_SEC) / 1000);
+		hdr->burst_seq     = htonl(burst_seq);
+		hdr->burst_idx     = htons(i);
+		hdr->burst_len     = htons(b->len);
+		hdr->intended_ns   = htobe64(launch);
+		hdr->actual_ns     = htobe64(actual);
+	}
+}
+
+static int burst_send(int sockfd, struct burst *b)
+{
+	int res;
+
+	res = sendmmsg(sockfd, b->mmsg, b->len, 0);
+	if (res < 0) {
+		perror("- sendmmsg");
+		return res;
+	}
+	if (res < b->len)
+		fprintf(stderr, "Managed to send %d packets of burst %d\n",
+			res, b->len);
+	return res;
+}
+
+/* Attribute a TX timestamp to the packet with OPT_ID key, the
+ * layers report in order sched, software (driver), hardware.
+ */
+static void tx_tstamp_record(struct stream *s, uint32_t key, uint32_t type,
+			     struct scm_timestamping *tss)
+{
+	struct stream_stat *stat = &s->stats;
+	struct tx_tstamp_slot *slot = &s->tx_ring[key % TX_TSTAMP_RING];
+	uint64_t sw = timespec_ns(&tss->ts[0]);
+	uint64_t hw = timespec_ns(&tss->ts[2]);
+
+	stat->tx_tstamps++;
+	if ((uint32_t)(s->tx_key - key) > TX_TSTAMP_RING) {
+		stat->tx_unmatched++;
 		return;
+	}
 
-	hdr = (struct pktgen_hdr*)buf;
-	hdr->tv_sec    = htonl(ts->tv_sec);
-	hdr->tv_usec   = htonl(ts->tv_nsec / 1000);
-	hdr->pgh_magic = htonl(PKTGEN_MAGIC);
-	hdr->seq_num   = htonl(sequence++);
+	switch (type) {
+	case SCM_TSTAMP_SCHED:
+		slot->sched = sw;
+		if (sw >= slot->user)
+			histogram_add(&stat->tx_sched, sw - slot->user);
+		break;
+	case SCM_TSTAMP_SND:
+		if (hw) {
+			if (slot->sw && hw >= slot->sw)
+				histogram_add(&stat->tx_hw, hw - slot->sw);
+			break;
+		}
+		slot->sw = sw;
+		if (slot->sched && sw >= slot->sched)
+			histogram_add(&stat->tx_driver, sw - slot->sched);
+		break;
+	}
 }
 
-static int socket_send(int sockfd, char *msg_buf, int msg_sz, int batch)
+/* Reap the socket error queue.  Qdisc report dropped packets
+ * (e.g. missed launch time) when SOF_TXTIME_REPORT_ERRORS is set,
+ * and SO_TIMESTAMPING loops back TX timestamps here.
+ */
+static void reap_errqueue(struct stream *s)
 {
-	uint64_t total = 0;
-	int cnt, res = 0;
-	int flags = 0;
-
-	/* Send a batch of the same packet  */
-	for (cnt = 0; cnt < batch; cnt++) {
-		res = send(sockfd, msg_buf, msg_sz, flags);
-		if (res < 0) {
-			fprintf(stderr, "Managed to send %d packets\n", cnt);
-			perror("- send");
-			goto out;
+	char control[512];
+	struct scm_timestamping *tss = NULL;
+	struct stream_stat *stat = &s->stats;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	char buf[64];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(s->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return; /* EAGAIN: queue empty */
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+				tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+				continue;
+			}
+			if (!((cmsg->cmsg_level == SOL_IP &&
+			       cmsg->cmsg_type == IP_RECVERR) ||
+			      (cmsg->cmsg_level == SOL_IPV6 &&
+			       cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+				/* Timestamp cmsg precede the serr cmsg */
+				if (tss && s->tx_ring)
+					tx_tstamp_record(s, serr->ee_data,
+							 serr->ee_info, tss);
+				tss = NULL;
+				continue;
+			}
+			if (serr->ee_origin != SO_EE_ORIGIN_TXTIME)
+				continue;
+			if (serr->ee_code == SO_EE_CODE_TXTIME_MISSED)
+				stat->txtime_missed += serr->ee_data;
+			else
+				stat->txtime_invalid += serr->ee_data;
 		}
-		total += res;
 	}
-	res = cnt;
-out:
-	return res;
+}
+
+/* Record userspace send time of a burst, for the OPT_ID keys the
+ * kernel will assign to the packets.
+ */
+static void tx_tstamp_user(struct stream *s, int len)
+{
+	struct timespec now;
+	uint64_t ns;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ns = timespec_ns(&now);
+	for (i = 0; i < len; i++) {
+		struct tx_tstamp_slot *slot;
+
+		slot = &s->tx_ring[(s->tx_key + i) % TX_TSTAMP_RING];
+		slot->user  = ns;
+		slot->sched = 0;
+		slot->sw    = 0;
+	}
+}
+
+/* Binary min-heap of streams, ordered by wakeup time.  On equal
+ * wakeup time, the stream with highest priority goes first.
+ */
+static inline int stream_before(struct stream *a, struct stream *b)
+{
+	if (a->wake_ns != b->wake_ns)
+		return a->wake_ns < b->wake_ns;
+	return a->prio > b->prio;
+}
+
+static void heap_sift_down(struct stream **heap, int len, int i)
+{
+	struct stream *tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < len) {
+		if (child + 1 < len && stream_before(heap[child + 1], heap[child]))
+			child++;
+		if (!stream_before(heap[child], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void heap_build(struct stream **heap, int len)
+{
+	int i;
+
+	for (i = len / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, len, i);
+}
+
+static void stream_advance(struct stream *s, struct thread_param *par)
+{
+	s->next.tv_sec  += s->interval / USEC_PER_SEC;
+	s->next.tv_nsec += (s->interval % USEC_PER_SEC) * 1000;
+	tsnorm(&s->next);
+
+	/* With txtime, wakeup early and let qdisc launch at "next" */
+	s->wake = s->next;
+	if (par->txtime)
+		timespec_sub_ns(&s->wake, par->txtime_delta * 1000);
+	s->wake_ns = timespec_ns(&s->wake);
+}
+
+static void stream_print_stats(struct stream *s)
+{
+	struct stream_stat *stat = &s->stats;
+	char ip[INET6_ADDRSTRLEN] = {0};
+	struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&s->dest_addr;
+	struct sockaddr_in  *a4 = (struct sockaddr_in *)&s->dest_addr;
+	char name[128];
+
+	if (s->addr_family == AF_INET6)
+		inet_ntop(AF_INET6, &a6->sin6_addr, ip, sizeof(ip));
+	else
+		inet_ntop(AF_INET, &a4->sin_addr, ip, sizeof(ip));
+
+	printf(" stream:%d dest:%s port:%d interval:%lu batch:%d prio:%d"
+	       " cycles:%lu packets:%lu send-errors:%lu",
+	       s->id, ip, ntohs(a4->sin_port), s->interval, s->batch,
+	       s->prio, stat->cycles, stat->packets, stat->send_errors);
+	if (stat->txtime_missed || stat->txtime_invalid)
+		printf(" txtime-missed:%lu txtime-invalid:%lu",
+		       stat->txtime_missed, stat->txtime_invalid);
+	printf("\n");
+	snprintf(name, sizeof(name), " stream:%d lateness", s->id);
+	histogram_print_summary(&stat->wakeup_err, name, "nsec");
+	if (!s->tx_ring)
+		return;
+	snprintf(name, sizeof(name), " stream:%d send-to-sched", s->id);
+	histogram_print_summary(&stat->tx_sched, name, "nsec");
+	snprintf(name, sizeof(name), " stream:%d sched-to-driver", s->id);
+	histogram_print_summary(&stat->tx_driver, name, "nsec");
 }
 
 void *timer_thread(void *param)
 {
 	struct thread_param *par = param;
-	struct thread_stat *stat = par->stats;
+	struct thread_stat *tstat = par->stats;
+	struct stream **heap;
+	int nr = par->nr_streams;
 
-	int timermode = TIMER_ABSTIME;
 	int clock = par->clock;
 
-	struct timespec now, next, interval;
+	struct timespec now;
 	struct sched_param schedp;
-	int err;
-
-	char *msg_buf;
-	int msg_sz = par->msg_sz;
-
-	/* Allocate payload buffer */
-	msg_buf = calloc(1, msg_sz);
-	if (!msg_buf) {
-		fprintf(stderr, "ERROR: %s() failed in calloc()\n", __func__);
-		goto merr;
+	struct histogram total, tx_sched, tx_driver, tx_hw;
+	unsigned long tx_tstamps = 0, tx_unmatched = 0;
+	unsigned long cycles = 0, packets = 0, send_errors = 0;
+	unsigned long missed = 0, invalid = 0;
+	int i, err;
+
+	struct stream *s;
+	int res;
+
+	/* Scheduler reorders heap, keep par->streams in id order */
+	heap = calloc(nr, sizeof(*heap));
+	if (!heap) {
+		fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+		goto out;
 	}
-	/* Add test contents easy viewable via nc */
-	// memset(msg_buf, 'A', msg_sz);
-	// msg_buf[0]='\n';
+	memcpy(heap, par->streams, nr * sizeof(*heap));
 
 	/* Setup sched priority: Have huge impact on wakeup accuracy */
 	memset(&schedp, 0, sizeof(schedp));
@@ -222,30 +694,39 @@ void *timer_thread(void *param)
 			goto out;
 	}
 
-	interval.tv_sec = par->interval / USEC_PER_SEC;
-	interval.tv_nsec = (par->interval % USEC_PER_SEC) * 1000;
+	if (par->cpu >= 0)
+		pin_to_cpu(par->cpu);
 
 	clock_gettime(clock, &now);
 
-	next = now;
-	next.tv_sec  += interval.tv_sec;
-	next.tv_nsec += interval.tv_nsec;
-	tsnorm(&next);
+	/* Prebuild burst of packets, and schedule first period */
+	for (i = 0; i < nr; i++) {
+		s = heap[i];
+		s->burst = burst_alloc(s->batch, par->msg_sz, par->txtime);
+		s->next = now;
+		stream_advance(s, par);
+	}
+	heap_build(heap, nr);
 
-	stat->thread_started++;
+	tstat->thread_started++;
 
-	while (!shutdown_global) {
+	while (!shutdown_global && nr > 0) {
+		struct stream_stat *stat;
 		uint64_t diff;
 		int err;
 
+		/* Stream with earliest deadline */
+		s = heap[0];
+		stat = &s->stats;
+
 		/* Wait for next period */
-		err = clock_nanosleep(clock, timermode, &next, NULL);
+		err = wait_until(clock, par->wakeup, &s->wake, par->spin_margin);
 		/* Took case MODE_CLOCK_NANOSLEEP from cyclictest */
 		if (err) {
 			if (err != EINTR)
 				fprintf(stderr, "clock_nanosleep failed."
 					" err:%d errno:%d\n", err, errno);
-			goto out;
+			break;
 		}
 
 		/* Expecting to wakeup at "next" get systime "now" to check */
@@ -254,51 +735,113 @@ void *timer_thread(void *param)
 			if (err != EINTR)
 				fprintf(stderr, "clock_getttime() failed."
 					" err:%d errno:%d\n", err, errno);
-			goto out;
+			break;
 		}
 
-		/* Detect inaccuracy diff */
-		diff = calcdiff(now, next);
-		if (diff < stat->min)
-			stat->min = diff;
-		if (diff > stat->max)
-			stat->max = diff;
-		stat->avg += (double) diff;
-		stat->act = diff;
+		/* Detect inaccuracy diff, aka lateness */
+		diff = timespec_ns(&now) - s->wake_ns;
+		histogram_add(&stat->wakeup_err, diff);
 
 		stat->cycles++;
 
-		/* Send diff as pktgen seq */
-		fill_buf_pktgen(msg_buf, msg_sz, &now, diff);
-		socket_send(par->sockfd, msg_buf, msg_sz, par->batch);
+		/* Actual send time, just before handing burst to kernel */
+		clock_gettime(clock, &now);
+		burst_fill(s->burst, stat->cycles, stat->packets,
+			   timespec_ns(&s->next), par->txtime_gap,
+			   timespec_ns(&now));
+		if (s->tx_ring)
+			tx_tstamp_user(s, s->burst->len);
+		res = burst_send(s->sockfd, s->burst);
+		if (res > 0) {
+			stat->packets += res;
+			s->tx_key += res;
+		} else {
+			stat->send_errors++;
+		}
+		if (par->txtime || par->tx_tstamp)
+			reap_errqueue(s);
 
 		if (verbose >=1 )
-			printf("Diff at cycle:%lu min:%ld cur:%ld max:%ld\n",
-			       stat->cycles, stat->min, stat->act, stat->max);
-
-		next.tv_sec  += interval.tv_sec;
-		next.tv_nsec += interval.tv_nsec;
-		tsnorm(&next);
+			printf("Diff at stream:%d cycle:%lu lateness:%lu nsec\n",
+			       s->id, stat->cycles, diff);
+
+		/* Reschedule, or remove stream when done */
+		if (par->max_cycles && par->max_cycles == stat->cycles) {
+			heap[0] = heap[--nr];
+			heap[nr] = s;
+		} else {
+			stream_advance(s, par);
+		}
+		heap_sift_down(heap, nr, 0);
+	}
 
-		if (par->max_cycles && par->max_cycles == stat->cycles)
-			break;
+	/* Last timestamps can still be in flight */
+	if (par->tx_tstamp)
+		usleep(10000);
+
+	histogram_init(&total);
+	histogram_init(&tx_sched);
+	histogram_init(&tx_driver);
+	histogram_init(&tx_hw);
+	for (i = 0; i < par->nr_streams; i++) {
+		s = par->streams[i];
+		if (par->txtime || par->tx_tstamp)
+			reap_errqueue(s);
+		cycles      += s->stats.cycles;
+		packets     += s->stats.packets;
+		send_errors += s->stats.send_errors;
+		missed      += s->stats.txtime_missed;
+		invalid     += s->stats.txtime_invalid;
+		histogram_merge(&total, &s->stats.wakeup_err);
+		histogram_merge(&tx_sched, &s->stats.tx_sched);
+		histogram_merge(&tx_driver, &s->stats.tx_driver);
+		histogram_merge(&tx_hw, &s->stats.tx_hw);
+		tx_tstamps   += s->stats.tx_tstamps;
+		tx_unmatched += s->stats.tx_unmatched;
+	}
 
+	/* Avoid interleaving output from several threads */
+	pthread_mutex_lock(&print_lock);
+	printf("Thread:%d ended stats: streams:%d cycles:%lu"
+	       " packets:%lu send-errors:%lu\n",
+	       par->id, par->nr_streams, cycles, packets, send_errors);
+	if (par->nr_streams > 1)
+		for (i = 0; i < par->nr_streams; i++)
+			stream_print_stats(par->streams[i]);
+	printf(" Wakeup mode:%s", wakeup_names[par->wakeup]);
+	if (par->wakeup == WAKEUP_HYBRID)
+		printf(" spin-margin:%lu usec", par->spin_margin);
+	printf("\n");
+	histogram_print(&total, "wakeup error", "nsec");
+	if (par->txtime)
+		printf(" txtime: launch-delta:%lu usec gap:%lu nsec"
+		       " missed:%lu invalid:%lu\n",
+		       par->txtime_delta, par->txtime_gap, missed, invalid);
+	if (par->tx_tstamp) {
+		printf(" tx-tstamp: timestamps:%lu unmatched:%lu\n",
+		       tx_tstamps, tx_unmatched);
+		histogram_print(&tx_sched, "send-to-sched", "nsec");
+		histogram_print(&tx_driver, "sched-to-driver", "nsec");
+		if (tx_hw.count)
+			histogram_print(&tx_hw, "driver-to-hw", "nsec");
 	}
-	printf("Thread ended stats: cycles:%lu min:%ld max:%ld\n",
-	       stat->cycles, stat->min, stat->max);
+	pthread_mutex_unlock(&print_lock);
 
 out:
-	free(msg_buf);
-merr:
-	shutdown_global = 1;
-	stat->thread_started = -1;
+	for (i = 0; i < par->nr_streams; i++) {
+		if (par->streams[i]->burst)
+			burst_free(par->streams[i]->burst);
+		free(par->streams[i]->tx_ring);
+	}
+	free(heap);
+	tstat->thread_started = -1;
 	return NULL;
 }
 
-static struct thread_param *setup_pthread(struct cfg_params *cfg)
+static struct thread_param *setup_pthread(struct cfg_params *cfg, int id)
 {
 	pthread_attr_t attr;
-	int status;
+	int status, i;
 
 	struct thread_param *par;
 	struct thread_stat *stat;
@@ -316,24 +859,35 @@ static struct thread_param *setup_pthread(struct cfg_params *cfg)
 		exit(EXIT_FAIL_PTHREAD);
 	}
 
-	par->interval   = cfg->interval;
+	par->id         = id;
+	par->cpu        = (cfg->cpu >= 0) ? cfg->cpu + id : -1;
 	par->max_cycles = cfg->count;
-	par->clock      = CLOCK_MONOTONIC;
+	/* ETF qdisc only support CLOCK_TAI, loop runs in qdisc clock */
+	par->clock      = (cfg->txtime == TXTIME_ETF) ? CLOCK_TAI :
+							CLOCK_MONOTONIC;
+	par->txtime       = cfg->txtime;
+	par->txtime_delta = cfg->txtime_delta;
+	par->txtime_gap   = cfg->txtime_gap;
+	par->wakeup       = cfg->wakeup;
+	par->spin_margin  = cfg->spin_margin;
+	par->tx_tstamp    = cfg->tx_tstamp;
 	par->prio       = cfg->thread_prio;
 	if (par->prio)
 		par->policy = SCHED_FIFO;
 	else
 		par->policy = SCHED_OTHER;
 
-	/* Info for sending packets */
-	par->sockfd = cfg->sockfd;
-	par->batch  = cfg->batch;
-	par->msg_sz = cfg->msg_sz;
+	/* Shard streams round-robin over threads */
+	par->msg_sz  = cfg->msg_sz;
+	par->streams = calloc(cfg->nr_streams, sizeof(*par->streams));
+	if (!par->streams) {
+		fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	for (i = id; i < cfg->nr_streams; i += cfg->threads)
+		par->streams[par->nr_streams++] = &cfg->streams[i];
 
 	par->stats = stat;
-	stat->min = 1000000;
-	stat->max = 0;
-	stat->avg = 0.0;
 
 	stat->thread_started = 1;
 	status = pthread_create(&stat->thread, &attr, timer_thread, par);
@@ -345,24 +899,109 @@ static struct thread_param *setup_pthread(struct cfg_params *cfg)
 	return par;
 }
 
-void setup_socket(struct cfg_params *p, char *dest_ip_string)
+void setup_socket(struct cfg_params *p, struct stream *s)
 {
-	/* Setup dest_addr - will exit prog on invalid input */
-	setup_sockaddr(p->addr_family, &p->dest_addr,
-		       dest_ip_string, p->dest_port);
-
 	/* Socket setup stuff */
-	p->sockfd = Socket(p->addr_family, SOCK_DGRAM, IPPROTO_UDP);
+	s->sockfd = Socket(s->addr_family, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (p->txtime) {
+		struct sock_txtime txt = {
+			.clockid = (p->txtime == TXTIME_ETF) ? CLOCK_TAI :
+							       CLOCK_MONOTONIC,
+			.flags   = SOF_TXTIME_REPORT_ERRORS,
+		};
+
+		if (setsockopt(s->sockfd, SOL_SOCKET, SO_TXTIME,
+			       &txt, sizeof(txt)) < 0) {
+			printf("ERROR: No support for SO_TXTIME\n");
+			perror("- setsockopt(SO_TXTIME)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
 
-	// TODO: Do we need some setsockopt() ?
+	if (p->tx_tstamp) {
+		int flags = TX_TSTAMP_FLAGS;
+
+		if (setsockopt(s->sockfd, SOL_SOCKET, SO_TIMESTAMPING,
+			       &flags, sizeof(flags)) < 0) {
+			printf("ERROR: No support for SO_TIMESTAMPING\n");
+			perror("- setsockopt(SO_TIMESTAMPING)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+		s->tx_ring = calloc(TX_TSTAMP_RING, sizeof(*s->tx_ring));
+		if (!s->tx_ring) {
+			fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+			exit(EXIT_FAIL_MEM);
+		}
+	}
+
+	/* Priority select qdisc band/class, e.g. with prio or mqprio */
+	if (s->prio)
+		Setsockopt(s->sockfd, SOL_SOCKET, SO_PRIORITY,
+			   &s->prio, sizeof(s->prio));
 
 	/* Connect to recv ICMP error messages, and to avoid the
 	 * kernel performing connect/unconnect cycles
 	 */
-	Connect(p->sockfd,
-		(struct sockaddr *)&p->dest_addr,
-		sockaddr_len(&p->dest_addr));
+	Connect(s->sockfd,
+		(struct sockaddr *)&s->dest_addr,
+		sockaddr_len(&s->dest_addr));
+
+}
+
+static struct stream *add_stream(struct cfg_params *p)
+{
+	struct stream *s;
+
+	p->streams = realloc(p->streams,
+			     (p->nr_streams + 1) * sizeof(*p->streams));
+	if (!p->streams) {
+		fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	s = &p->streams[p->nr_streams];
+	memset(s, 0, sizeof(*s));
+	s->id          = p->nr_streams++;
+	s->addr_family = p->addr_family;
+	s->interval    = p->interval;
+	s->batch       = p->batch;
+	histogram_init(&s->stats.wakeup_err);
+	histogram_init(&s->stats.tx_sched);
+	histogram_init(&s->stats.tx_driver);
+	histogram_init(&s->stats.tx_hw);
+	return s;
+}
 
+/* Parse --stream IPADDR[,PORT[,INTERVAL[,BATCH[,PRIO]]]]
+ * Omitted fields take the global setting.
+ */
+static int parse_stream(struct cfg_params *p, char *spec)
+{
+	char *field[5] = { NULL };
+	char *str, *save = NULL;
+	uint16_t port = p->dest_port;
+	struct stream *s;
+	int i;
+
+	str = strdup(spec);
+	for (i = 0; i < 5; i++)
+		if (!(field[i] = strtok_r(i ? NULL : str, ",", &save)))
+			break;
+	if (!field[0]) {
+		free(str);
+		return -1;
+	}
+
+	s = add_stream(p);
+	if (strchr(field[0], ':'))
+		s->addr_family = AF_INET6;
+	if (field[1]) port        = atoi(field[1]);
+	if (field[2]) s->interval = atoi(field[2]);
+	if (field[3]) s->batch    = atoi(field[3]);
+	if (field[4]) s->prio     = atoi(field[4]);
+	setup_sockaddr(s->addr_family, &s->dest_addr, field[0], port);
+	free(str);
+	return 0;
 }
 
 static void init_params(struct cfg_params *p)
@@ -375,20 +1014,69 @@ static void init_params(struct cfg_params *p)
 	p->addr_family = AF_INET; /* Default address family */
 	p->dest_port = 6666;
 	p->interval = DEFAULT_INTERVAL;
+	p->txtime_delta = 500; /* usec */
+	p->wakeup = WAKEUP_SLEEP;
+	p->spin_margin = 100; /* usec */
+	p->threads = 1;
+	p->cpu = -1;
 }
 
 int main(int argc, char *argv[])
 {
-	struct thread_param *thread;
-	int c, longindex = 0;
+	struct thread_param **threads;
+	int c, i, longindex = 0;
 	struct cfg_params p;
-	char *dest_ip_str;
+	char **stream_specs;
+	int nr_specs = 0, nr_base = 0;
+	int running;
 
 	init_params(&p); /* Default settings */
 
+	stream_specs = calloc(argc, sizeof(*stream_specs));
+	if (!stream_specs) {
+		fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "h6c:p:m:v:b:P:s:",
+	while ((c = getopt_long(argc, argv, "h6c:p:m:v:b:P:s:T::w:S:n:t:",
 				long_options, &longindex)) != -1) {
+		if (c == 0) {
+			/* handle options without short version */
+			if (!strcmp(long_options[longindex].name,
+				    "txtime-delta"))
+				p.txtime_delta = atoi(optarg);
+			if (!strcmp(long_options[longindex].name,
+				    "txtime-gap"))
+				p.txtime_gap = atoi(optarg);
+			if (!strcmp(long_options[longindex].name,
+				    "spin-margin"))
+				p.spin_margin = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "cpu"))
+				p.cpu = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "tx-tstamp"))
+				p.tx_tstamp = 1;
+		}
+		if (c == 'w') {
+			for (i = 0; i <= WAKEUP_SPIN; i++)
+				if (!strcmp(optarg, wakeup_names[i]))
+					break;
+			if (i > WAKEUP_SPIN)
+				return usage(argv);
+			p.wakeup = i;
+		}
+		if (c == 'T') {
+			if (!optarg || !strcmp(optarg, "etf"))
+				p.txtime = TXTIME_ETF;
+			else if (!strcmp(optarg, "fq"))
+				p.txtime = TXTIME_FQ;
+			else
+				return usage(argv);
+		}
+		/* Parsed after all options, to use global defaults */
+		if (c == 'S') stream_specs[nr_specs++] = optarg;
+		if (c == 'n') nr_base       = atoi(optarg);
+		if (c == 't') p.threads     = atoi(optarg);
 		if (c == 'c') p.count       = atoi(optarg);
 		if (c == 'p') p.dest_port   = atoi(optarg);
 		if (c == 'P') p.thread_prio = atoi(optarg);
@@ -399,40 +1087,80 @@ int main(int argc, char *argv[])
 		if (c == 'v') verbose     = optarg ? atoi(optarg) : 1;
 		if (c == 'h' || c == '?') return usage(argv);
 	}
-	if (optind >= argc) {
+
+	for (i = 0; i < nr_specs; i++)
+		if (parse_stream(&p, stream_specs[i]) < 0)
+			return usage(argv);
+	free(stream_specs);
+
+	/* IPADDR argument adds --streams N (default 1) with port+N */
+	if (optind < argc) {
+		if (nr_base < 1)
+			nr_base = 1;
+		for (i = 0; i < nr_base; i++) {
+			struct stream *s = add_stream(&p);
+
+			setup_sockaddr(s->addr_family, &s->dest_addr,
+				       argv[optind], p.dest_port + i);
+		}
+	}
+	if (p.nr_streams == 0) {
 		fprintf(stderr,
 			"Expected dest IP-address argument after options\n");
 		return usage(argv);
 	}
-	dest_ip_str = argv[optind];
+	if (p.threads < 1)
+		p.threads = 1;
+	if (p.threads > p.nr_streams)
+		p.threads = p.nr_streams;
 	if (verbose > 0)
-		printf("Destination IP:%s port:%d\n", dest_ip_str, p.dest_port);
+		printf("Streams:%d threads:%d\n", p.nr_streams, p.threads);
 
-	/* Setup socket - will exit prog on invalid input */
-	setup_socket(&p, dest_ip_str);
+	/* Setup sockets - will exit prog on invalid input */
+	for (i = 0; i < p.nr_streams; i++)
+		setup_socket(&p, &p.streams[i]);
 
 	signal(SIGINT, sighand);
 	signal(SIGTERM, sighand);
 	signal(SIGUSR1, sighand);
 
-	thread = setup_pthread(&p);
-
-	while (!shutdown_global) {
-		sleep(0.5);
-
-		//if (p.count && thread->stats->cycles >= p.count)
-		//	break;
+	threads = calloc(p.threads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "%s(): Mem alloc error\n", __func__);
+		exit(EXIT_FAIL_MEM);
 	}
+	for (i = 0; i < p.threads; i++)
+		threads[i] = setup_pthread(&p, i);
+
+	/* Wait for all threads to finish, or a signal */
+	do {
+		usleep(100000);
+		running = 0;
+		for (i = 0; i < p.threads; i++)
+			if (threads[i]->stats->thread_started > 0)
+				running++;
+	} while (!shutdown_global && running);
 	printf("Main shutdown\n");
+	shutdown_global = 1;
+
+	for (i = 0; i < p.threads; i++) {
+		struct thread_param *thread = threads[i];
 
-	/* Shutdown pthread before calling free */
-	if (thread->stats->thread_started > 0)
-		pthread_kill(thread->stats->thread, SIGTERM);
-	if (thread->stats->thread_started)
-		pthread_join(thread->stats->thread, NULL);
+		/* Shutdown pthread before calling free */
+		if (thread->stats->thread_started > 0)
+			pthread_kill(thread->stats->thread, SIGTERM);
+		if (thread->stats->thread_started)
+			pthread_join(thread->stats->thread, NULL);
+
+		free(thread->streams);
+		free(thread->stats);
+		free(thread);
+	}
+	free(threads);
 
-	free(thread->stats);
-	free(thread);
+	for (i = 0; i < p.nr_streams; i++)
+		close(p.streams[i].sockfd);
+	free(p.streams);
 
 	printf("Main exit\n");
 	return EXIT_OK;
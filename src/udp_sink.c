@@ -25,6 +25,13 @@ static const char *__doc__=
 #include <sys/uio.h> /* struct iovec */
 #include <errno.h>
 #include <stdbool.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <math.h>
 #include <linux/filter.h>
 
 #include <getopt.h>
@@ -40,12 +47,51 @@ static const char *__doc__=
 #define SO_ATTACH_REUSEPORT_CBPF	51
 #endif
 
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#define SO_BUSY_POLL_BUDGET	70
+#endif
+
+/* Per epoll instance busy poll params, kernel v6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE	0x8A
+#define EPIOCSPARAMS	_IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
 #define RUN_RECVMSG   0x1
 #define RUN_RECVMMSG  0x2
 #define RUN_RECVFROM  0x4
 #define RUN_READ      0x8
 #define RUN_RECV      0x10
 #define RUN_ALL (RUN_RECVMSG | RUN_RECVMMSG | RUN_RECVFROM | RUN_READ |RUN_RECV)
+/* Not part of RUN_ALL, analyze udp_pacer streams */
+#define RUN_JITTER    0x20
+#define RUN_EPOLL     0x40
+
+/* Application cost of using the payload, after each receive */
+enum touch_mode {
+	TOUCH_NONE = 0,
+	TOUCH_READ,	/* read one word per cache line */
+	TOUCH_CHECKSUM,	/* 64-bit sum of all payload words */
+	TOUCH_COPY,	/* memcpy into application ring */
+	TOUCH_MAX,
+};
+
+static const char *touch_names[] = {
+	[TOUCH_NONE]	 = "none",
+	[TOUCH_READ]	 = "read",
+	[TOUCH_CHECKSUM] = "checksum",
+	[TOUCH_COPY]	 = "copy",
+};
+
+#define CACHE_LINE_SZ	64
+#define TOUCH_RING_KB	8192 /* larger than most L2 caches */
 
 struct sink_params {
 	struct params_common c;
@@ -66,12 +112,42 @@ struct sink_params {
 	int so_reuseport;
 	int use_bpf;
 	int buf_sz;
+	/* Expected udp_pacer stream, for jitter analysis */
+	unsigned long interval; /* usec */
+	int burst;
+	/* Kernel busy polling, socket options and epoll params */
+	int busy_poll;		/* usec, SO_BUSY_POLL */
+	int prefer_busy_poll;
+	int busy_poll_budget;
+	int epoll_busy_poll;	/* usec, EPIOCSPARAMS */
+	/* Many port fan-in, sockets shared by epoll workers */
+	int nr_ports;
+	int workers;
+	int exclusive;		/* EPOLLEXCLUSIVE */
+	int budget;		/* max pkts drained per socket per event */
+	/* Connected sockets sharing listen port, one per sender port */
+	int conn_socks;
+	char *conn_peer;
+	uint16_t conn_sport;
+	/* A/B test ip_early_demux + udp_early_demux between runs */
+	int demux_ab;
+	/* Payload touch, modes run in the order given by --touch */
+	int touch;
+	unsigned int touch_modes;	/* bitmask of touch_mode */
+	int touch_order[TOUCH_MAX];
+	int nr_touch;
+	char *touch_ring;
+	size_t touch_ring_sz;
+	size_t touch_ring_off;
+	uint64_t touch_sum; /* keep compiler from dropping reads */
 	unsigned int run_flag;
 	unsigned int run_flag_curr;
 	/* TODO: Below stats should move to separate stats struct */
 	long long ooo;
 	long long bad_magic;
 	long long bad_repeat;
+	struct jitter_stats *js;
+	struct histogram *rx_lat;
 };
 
 static const struct option long_options[] = {
@@ -105,6 +181,24 @@ static const struct option long_options[] = {
 	{"repeat",	required_argument,	NULL, 'r' },
 	{"verbose",	optional_argument,	NULL, 'v' },
 	{"connect",	optional_argument,	NULL, 'C' },
+	{"jitter",	no_argument,		NULL, 0 },
+	{"interval",	required_argument,	NULL, 0 },
+	{"burst",	required_argument,	NULL, 0 },
+	{"epoll",	no_argument,		NULL, 'E' },
+	{"busy-poll",	required_argument,	NULL, 0 },
+	{"prefer-busy-poll",no_argument,	NULL, 0 },
+	{"busy-poll-budget",required_argument,	NULL, 0 },
+	{"epoll-busy-poll",required_argument,	NULL, 0 },
+	{"ports",	required_argument,	NULL, 0 },
+	{"workers",	required_argument,	NULL, 0 },
+	{"exclusive",	no_argument,		NULL, 0 },
+	{"budget",	required_argument,	NULL, 0 },
+	{"conn-socks",	required_argument,	NULL, 0 },
+	{"conn-peer",	required_argument,	NULL, 0 },
+	{"conn-sport",	required_argument,	NULL, 0 },
+	{"demux-ab",	no_argument,		NULL, 0 },
+	{"touch",	required_argument,	NULL, 0 },
+	{"touch-ring",	required_argument,	NULL, 0 },
 	{0, 0, NULL,  0 }
 };
 
@@ -135,6 +229,59 @@ static int usage(char *argv[])
 	printf("     -u -U -t -T: run any combination of"
 			" recvmsg/recvmmsg/recvfrom/read\n");
 	printf("\n");
+	printf("Option --jitter analyzes a udp_pacer stream (one per port),\n"
+	       " using SO_TIMESTAMPNS receive timestamps.  Histograms of\n"
+	       " inter-arrival time, burst spread (first to last pkt), period\n"
+	       " error and RFC 3550 transit difference are printed, plus the\n"
+	       " RFC 3550 jitter estimate.  Send times are taken from the\n"
+	       " pacer header; for other senders give --interval USEC (and\n"
+	       " --burst N) and bursts are detected from arrival gaps.\n");
+	printf("\n");
+	printf("Busy polling, compare latency and CPU usage per mode:\n"
+	       " --busy-poll USEC      : SO_BUSY_POLL, blocking recv busy polls,\n"
+	       "   recvmsg/recvmmsg report kernel-to-user latency\n"
+	       " --prefer-busy-poll    : SO_PREFER_BUSY_POLL (or epoll param)\n"
+	       " --busy-poll-budget N  : SO_BUSY_POLL_BUDGET (or epoll param)\n"
+	       " --epoll (-E)          : epoll_wait + recvmmsg drain loop,\n"
+	       "   reports wakeups and kernel-to-user latency (SO_TIMESTAMPNS)\n"
+	       " --epoll-busy-poll USEC: busy poll in epoll_wait, set per epoll\n"
+	       "   instance via EPIOCSPARAMS ioctl (kernel v6.9)\n");
+	printf("\n");
+	printf("Many port fan-in, --ports N binds port..port+N-1:\n"
+	       " --workers W    : W threads, each with own epoll instance\n"
+	       "                  that all sockets are registered with\n"
+	       " --exclusive    : register with EPOLLEXCLUSIVE, wakeup one\n"
+	       "                  worker per event (avoid thundering herd)\n"
+	       " --budget N     : drain ready socket with recvmmsg (--batch)\n"
+	       "                  up to N pkts, before next socket\n"
+	       " Reports aggregate pps, wakeups/sec and pkts per wakeup,\n"
+	       " for --count pkts in total.\n");
+	printf("\n");
+	printf("Connected socket lookup, --conn-socks N --conn-peer IP:\n"
+	       " creates N sockets bound to --port and connected to\n"
+	       " IP:--conn-sport (default 20000) .. +N-1, plus the wildcard\n"
+	       " socket, all received via the fan-in workers.  Pair with\n"
+	       " 'udp_flood --src-ports N'.  Reports pkts that missed the\n"
+	       " connected sockets and landed on the wildcard socket.\n");
+	printf("\n");
+	printf("Option --demux-ab toggles sysctl ip_early_demux and\n"
+	       " udp_early_demux (needs root) between the --repeat runs, in\n"
+	       " ABBA order to cancel drift (A=on, B=off), and reports the\n"
+	       " ns/pkt delta with a 95%% confidence interval.  Original\n"
+	       " settings are restored.  Early demux only finds connected\n"
+	       " sockets, so combine with --connect.\n");
+	printf("\n");
+	printf("Option --touch MODE[,MODE...] uses the payload after each\n"
+	       " receive, modelling application cost (not in fan-in modes):\n"
+	       "  none     : only count bytes (default)\n"
+	       "  read     : read one word per cache line\n"
+	       "  checksum : 64-bit sum of all payload words\n"
+	       "  copy     : memcpy into an application ring of\n"
+	       "             --touch-ring KB (default %d KB)\n"
+	       " With several modes, the runs are repeated per mode and the\n"
+	       " added ns/pkt relative to the first mode is reported.\n",
+	       TOUCH_RING_KB);
+	printf("\n");
 	printf("Hint: Following options takes an optional argument:\n"
 	       "  verbose=N and check-pktgen=N\n"
 	       "Notice must be specified with an equal sign "
@@ -255,6 +402,77 @@ void print_check_result(struct sink_params *p)
 	}
 }
 
+/* 64-bit sum of payload words.  Independent accumulators let the
+ * compiler vectorize the main loop, memcpy handles unaligned data.
+ */
+static uint64_t csum64(const char *buf, int len)
+{
+	uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, w[4];
+	int i;
+
+	for (i = 0; i + (int)sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(w, buf + i, sizeof(w));
+		a0 += w[0];
+		a1 += w[1];
+		a2 += w[2];
+		a3 += w[3];
+	}
+	for (; i + 8 <= len; i += 8) {
+		memcpy(w, buf + i, 8);
+		a0 += w[0];
+	}
+	for (; i < len; i++)
+		a1 += (uint8_t)buf[i];
+	return a0 + a1 + a2 + a3;
+}
+
+static void __touch_payload(struct sink_params *p, const char *buf, int len)
+{
+	uint64_t sum = 0;
+	int i;
+
+	switch (p->touch) {
+	case TOUCH_READ:
+		for (i = 0; i < len; i += CACHE_LINE_SZ)
+			sum += *(volatile const char *)(buf + i);
+		p->touch_sum += sum;
+		break;
+	case TOUCH_CHECKSUM:
+		p->touch_sum += csum64(buf, len);
+		break;
+	case TOUCH_COPY:
+		if (p->touch_ring_off + len > p->touch_ring_sz)
+			p->touch_ring_off = 0;
+		memcpy(p->touch_ring + p->touch_ring_off, buf, len);
+		/* Next slot cache line aligned, like an app ring */
+		p->touch_ring_off += (len + CACHE_LINE_SZ - 1) &
+				     ~(CACHE_LINE_SZ - 1);
+		break;
+	}
+}
+
+static inline
+void touch_payload(struct sink_params *p, const char *buf, int len)
+{
+	if (likely(!p->touch))
+		return;
+	__touch_payload(p, buf, len);
+}
+
+static inline
+void touch_iov(struct sink_params *p, struct iovec *iov, int nr, int len)
+{
+	int i, l;
+
+	if (likely(!p->touch))
+		return;
+	for (i = 0; i < nr && len > 0; i++) {
+		l = len < iov[i].iov_len ? len : iov[i].iov_len;
+		__touch_payload(p, iov[i].iov_base, l);
+		len -= l;
+	}
+}
+
 static int sink_with_read(int sockfd, struct sink_params *p,
 			  struct time_bench_record *r) {
 	int i, res;
@@ -270,6 +488,7 @@ static int sink_with_read(int sockfd, struct sink_params *p,
 			}
 			goto error;
 		}
+		touch_payload(p, buffer, res);
 		total += res;
 	}
 	r->bytes = total;
@@ -304,6 +523,7 @@ static int sink_with_recvfrom(int sockfd, struct sink_params *p,
 			}
 			goto error;
 		}
+		touch_payload(p, buffer, res);
 		total += res;
 	}
 	r->bytes = total;
@@ -339,6 +559,7 @@ static int sink_with_recv(int sockfd, struct sink_params *p,
 			}
 			goto error;
 		}
+		touch_payload(p, buffer, res);
 		total += res;
 	}
 	r->bytes = total;
@@ -406,6 +627,55 @@ static void check_msg_name(struct msghdr *msg_hdr,
 	}
 }
 
+static inline uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* SO_TIMESTAMPNS receive timestamp, or 0 if missing */
+static uint64_t rx_tstamp(struct msghdr *msg_hdr)
+{
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+
+	for (cmsg = CMSG_FIRSTHDR(msg_hdr); cmsg;
+	     cmsg = CMSG_NXTHDR(msg_hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+	}
+	return 0;
+}
+
+/* Kernel-to-user latency histogram, printed and freed by
+ * print_latency_result()
+ */
+static struct histogram *rx_lat_alloc(void)
+{
+	struct histogram *lat = malloc(sizeof(*lat));
+
+	if (!lat) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	histogram_init(lat);
+	return lat;
+}
+
+static inline void rx_lat_add(struct histogram *lat,
+			      struct msghdr *msg_hdr, uint64_t now)
+{
+	uint64_t rx = rx_tstamp(msg_hdr);
+
+	if (rx && now >= rx)
+		histogram_add(lat, now - rx);
+}
+
 #define CMSG_DLEN(cmsg) ((cmsg)->cmsg_len - sizeof(struct cmsghdr))
 static void check_cmsg(struct msghdr *msg_hdr, struct sink_params *p,
 		       int max_len)
@@ -415,7 +685,8 @@ static void check_cmsg(struct msghdr *msg_hdr, struct sink_params *p,
 	int found_ttl = 0;
 
 	if (!p->recv_ttl && !p->recv_pktinfo) {
-		if (msg_hdr->msg_controllen) {
+		/* Only SO_TIMESTAMPNS, when busy polling */
+		if (msg_hdr->msg_controllen && !p->busy_poll) {
 			printf("found unrequested cmsg data, len %zd\n",
 			       msg_hdr->msg_controllen);
 			exit(EXIT_FAIL_SOCK);
@@ -498,8 +769,13 @@ static int sink_with_recvmsg(int sockfd, struct sink_params *p,
 	msg_hdr->msg_iov    = msg_iov;
 	msg_hdr->msg_iovlen = p->iov_elems;
 
-	msg_hdr->msg_control = (p->recv_ttl || p->recv_pktinfo) ? cbuf: NULL;
-	msg_hdr->msg_controllen = (p->recv_ttl || p->recv_pktinfo) ?
+	/* Busy polling: track kernel-to-user latency, like --epoll */
+	if (p->busy_poll)
+		p->rx_lat = rx_lat_alloc();
+
+	msg_hdr->msg_control = (p->recv_ttl || p->recv_pktinfo || p->rx_lat) ?
+				cbuf: NULL;
+	msg_hdr->msg_controllen = (p->recv_ttl || p->recv_pktinfo || p->rx_lat) ?
 					sizeof(cbuf): 0;
 
 	/* Having several IOV's does not help much. The return value
@@ -522,6 +798,9 @@ static int sink_with_recvmsg(int sockfd, struct sink_params *p,
 		check_pkt(msg_iov, p->iov_elems, res, p);
 		check_msg_name(msg_hdr, &p->sender_addr);
 		check_cmsg(msg_hdr, p, sizeof(cbuf));
+		if (p->rx_lat)
+			rx_lat_add(p->rx_lat, msg_hdr, realtime_ns());
+		touch_iov(p, msg_iov, p->iov_elems, res);
 
 		total += res;
 	}
@@ -559,7 +838,7 @@ static int sink_with_recvmsg(int sockfd, struct sink_params *p,
 static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 			      struct time_bench_record *r) {
 	int cnt, i, res, pkt, batches = 0;
-	uint64_t total = 0, packets;
+	uint64_t total = 0, packets, now;
 	char *buffer = malloc_payload_buffer(p->buf_sz);
 	struct iovec  *msg_iov;  /* io-vector: array of pointers to payload data */
 	struct timespec __ts, ___ts = { .tv_sec = p->timeout, .tv_nsec = 0};
@@ -578,6 +857,10 @@ static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 	mmsg_hdr = malloc_mmsghdr(p->batch);         /* Alloc mmsghdr array */
 	msg_iov  = malloc_iovec(p->iov_elems*p->batch); /* Alloc I/O vector array */
 
+	/* Busy polling: track kernel-to-user latency, like --epoll */
+	if (p->busy_poll)
+		p->rx_lat = rx_lat_alloc();
+
 	/*** Setup packet structure for receiving
 	 ***/
 	for (pkt = 0; pkt < p->batch; pkt++) {
@@ -599,10 +882,9 @@ static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 		/* Binding io-vector to packet setup struct */
 		mmsg_hdr[pkt].msg_hdr.msg_iov    = &msg_iov[pkt*p->iov_elems];
 		mmsg_hdr[pkt].msg_hdr.msg_iovlen = p->iov_elems;
-		mmsg_hdr[pkt].msg_hdr.msg_control = (p->recv_ttl || p->recv_pktinfo) ?
-						cbuf[pkt]: NULL;
-		mmsg_hdr[pkt].msg_hdr.msg_controllen = (p->recv_ttl || p->recv_pktinfo) ?
-							sizeof(cbuf[pkt]): 0;
+		mmsg_hdr[pkt].msg_hdr.msg_control =
+			(p->recv_ttl || p->recv_pktinfo || p->rx_lat) ?
+			cbuf[pkt]: NULL;
 	}
 
 	if (p->timeout >= 0)
@@ -613,6 +895,11 @@ static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 	/* Receive LOOP */
 	for (cnt = 0; cnt < p->count; ) {
 		__ts = ___ts;
+		/* Kernel shrinks msg_controllen to the used length */
+		for (pkt = 0; pkt < p->batch; pkt++)
+			mmsg_hdr[pkt].msg_hdr.msg_controllen =
+				mmsg_hdr[pkt].msg_hdr.msg_control ?
+				sizeof(cbuf[pkt]) : 0;
 		res = recvmmsg(sockfd, mmsg_hdr, p->batch, flags, ts);
 		if (res < 0) {
 			if (errno == EAGAIN) {
@@ -622,13 +909,20 @@ static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 			goto error;
 		}
 		batches++;
+		now = p->rx_lat ? realtime_ns() : 0;
 		for (pkt = 0; pkt < res; pkt++) {
 			total += mmsg_hdr[pkt].msg_len;
+			if (p->rx_lat)
+				rx_lat_add(p->rx_lat, &mmsg_hdr[pkt].msg_hdr,
+					   now);
 			check_pkt(mmsg_hdr[pkt].msg_hdr.msg_iov,
 				  mmsg_hdr[pkt].msg_hdr.msg_iovlen,
 				  mmsg_hdr[pkt].msg_len, p);
 			check_msg_name(&mmsg_hdr[pkt].msg_hdr, &p->sender_addr);
 			check_cmsg(&mmsg_hdr[pkt].msg_hdr, p, sizeof(cbuf[pkt]));
+			touch_iov(p, mmsg_hdr[pkt].msg_hdr.msg_iov,
+				  mmsg_hdr[pkt].msg_hdr.msg_iovlen,
+				  mmsg_hdr[pkt].msg_len);
 		}
 		cnt += res;
 	}
@@ -663,6 +957,373 @@ static int sink_with_recvMmsg(int sockfd, struct sink_params *p,
 	exit(EXIT_FAIL_SOCK);
 }
 
+/*
+ * Jitter analysis of a paced stream (see udp_pacer).
+ *
+ * The receive time (R) is the kernel SO_TIMESTAMPNS stamp, which
+ * excludes the wakeup latency of this process.  The send time (S) is
+ * the intended send time in the pacer header.  The sender clock is
+ * not synchronized with ours, but only differences are used, so the
+ * clock offset cancels out.  For packets without a pacer header the
+ * bursts are detected from arrival gaps and S is derived from the
+ * expected --interval.
+ */
+struct jitter_stats {
+	struct histogram inter_arrival;	/* R(i) - R(i-1) */
+	struct histogram spread;	/* first to last pkt of burst */
+	struct histogram period_err;	/* burst start vs expected start */
+	struct histogram transit;	/* RFC 3550 |D(i-1,i)| */
+	double jitter;			/* RFC 3550 estimate J(i) */
+	uint64_t bursts;
+	uint64_t short_bursts;		/* fewer pkts than burst_len */
+	uint64_t lost;			/* gaps not filled by late pkts */
+	uint64_t reordered;
+	uint64_t no_tstamp;		/* fallback to clock_gettime */
+	uint64_t no_hdr;
+
+	/* state of previous packet and current burst */
+	int have_prev;
+	uint64_t prev_r, prev_s;
+	uint32_t prev_seq;
+	uint32_t burst_seq;
+	uint32_t burst_len;
+	uint32_t burst_pkts;
+	uint64_t burst_first_r, burst_first_s, burst_last_r;
+};
+
+static inline uint64_t abs_diff(int64_t d)
+{
+	return d < 0 ? -d : d;
+}
+
+static void jitter_burst_end(struct jitter_stats *js)
+{
+	js->bursts++;
+	histogram_add(&js->spread, js->burst_last_r - js->burst_first_r);
+	if (js->burst_len && js->burst_pkts < js->burst_len)
+		js->short_bursts++;
+}
+
+static void jitter_pkt(struct jitter_stats *js, struct sink_params *p,
+		       char *buf, int len, uint64_t r)
+{
+	struct pacer_hdr *ph = (struct pacer_hdr *)buf;
+	uint64_t interval = p->interval * 1000;
+	uint32_t burst_seq;
+	uint64_t s;
+	bool new_burst;
+
+	if (len >= sizeof(*ph) && ntohl(ph->pgh.pgh_magic) == PKTGEN_MAGIC) {
+		uint32_t seq = ntohl(ph->pgh.seq_num);
+		int32_t delta = seq - js->prev_seq;
+
+		/* prev_seq is the highest seen, a late packet fills a
+		 * gap previously counted as lost.
+		 */
+		if (!js->have_prev || delta > 0) {
+			if (js->have_prev)
+				js->lost += delta - 1;
+			js->prev_seq = seq;
+		} else {
+			js->reordered++;
+			if (delta < 0 && js->lost)
+				js->lost--;
+		}
+		burst_seq = ntohl(ph->burst_seq);
+		s = be64toh(ph->intended_ns);
+		new_burst = !js->have_prev || burst_seq != js->burst_seq;
+		if (new_burst)
+			js->burst_len = ntohs(ph->burst_len);
+	} else {
+		/* No pacer header, a gap of half an interval starts a burst */
+		js->no_hdr++;
+		new_burst = !js->have_prev || (interval &&
+			    r - js->prev_r > interval / 2) ||
+			    (p->burst && js->burst_pkts >= p->burst);
+		burst_seq = js->burst_seq + (js->have_prev && new_burst);
+		s = (uint64_t)burst_seq * interval;
+		js->burst_len = p->burst;
+	}
+
+	if (js->have_prev) {
+		int64_t d;
+
+		histogram_add(&js->inter_arrival, r - js->prev_r);
+		/* RFC 3550 sec 6.4.1: D(i,j) = (Rj - Ri) - (Sj - Si) */
+		d = (int64_t)(r - js->prev_r) - (int64_t)(s - js->prev_s);
+		histogram_add(&js->transit, abs_diff(d));
+		js->jitter += (abs_diff(d) - js->jitter) / 16;
+	}
+
+	if (new_burst) {
+		if (js->have_prev) {
+			uint64_t expect = s - js->burst_first_s;
+
+			jitter_burst_end(js);
+			histogram_add(&js->period_err,
+				      abs_diff((r - js->burst_first_r) - expect));
+		}
+		js->burst_seq = burst_seq;
+		js->burst_pkts = 0;
+		js->burst_first_r = r;
+		js->burst_first_s = s;
+	}
+	js->burst_pkts++;
+	js->burst_last_r = r;
+	js->prev_r = r;
+	js->prev_s = s;
+	js->have_prev = 1;
+}
+
+static void print_jitter_result(struct sink_params *p)
+{
+	struct jitter_stats *js = p->js;
+
+	if (!js)
+		return;
+
+	printf(" - jitter: RFC3550 %.0f ns bursts %lu short %lu"
+	       " lost %lu reordered %lu\n", js->jitter, js->bursts,
+	       js->short_bursts, js->lost, js->reordered);
+	if (js->no_hdr)
+		printf(" - %lu pkts without pacer header\n", js->no_hdr);
+	if (js->no_tstamp)
+		printf(" - %lu pkts without SO_TIMESTAMPNS\n", js->no_tstamp);
+	if (verbose > 1) {
+		histogram_print(&js->inter_arrival, "inter-arrival", "ns");
+		histogram_print(&js->spread, "burst-spread", "ns");
+		histogram_print(&js->period_err, "period-error", "ns");
+		histogram_print(&js->transit, "transit-diff", "ns");
+	} else {
+		histogram_print_summary(&js->inter_arrival, "inter-arrival", "ns");
+		histogram_print_summary(&js->spread, "burst-spread", "ns");
+		histogram_print_summary(&js->period_err, "period-error", "ns");
+		histogram_print_summary(&js->transit, "transit-diff", "ns");
+	}
+	free(js);
+	p->js = NULL;
+}
+
+static int sink_with_jitter(int sockfd, struct sink_params *p,
+			    struct time_bench_record *r) {
+	int cnt, res, pkt;
+	uint64_t total = 0;
+	int flags = p->dontwait ? MSG_DONTWAIT : 0;
+	char cbuf[p->batch][CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec *msg_iov;
+	struct mmsghdr *mmsg_hdr;
+	struct jitter_stats *js;
+
+	js = calloc(1, sizeof(*js));
+	if (!js) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	histogram_init(&js->inter_arrival);
+	histogram_init(&js->spread);
+	histogram_init(&js->period_err);
+	histogram_init(&js->transit);
+
+	mmsg_hdr = malloc_mmsghdr(p->batch);
+	msg_iov  = malloc_iovec(p->batch);
+	for (pkt = 0; pkt < p->batch; pkt++) {
+		msg_iov[pkt].iov_base = malloc_payload_buffer(p->buf_sz);
+		msg_iov[pkt].iov_len  = p->buf_sz;
+		mmsg_hdr[pkt].msg_hdr.msg_iov    = &msg_iov[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (cnt = 0; cnt < p->count; ) {
+		/* msg_controllen is updated by the kernel, reset it */
+		for (pkt = 0; pkt < p->batch; pkt++) {
+			mmsg_hdr[pkt].msg_hdr.msg_control    = cbuf[pkt];
+			mmsg_hdr[pkt].msg_hdr.msg_controllen = sizeof(cbuf[pkt]);
+		}
+		res = recvmmsg(sockfd, mmsg_hdr, p->batch, flags, NULL);
+		if (res < 0) {
+			if (errno == EAGAIN) {
+				r->try_again++;
+				continue;
+			}
+			goto error;
+		}
+		for (pkt = 0; pkt < res; pkt++) {
+			uint64_t rx = rx_tstamp(&mmsg_hdr[pkt].msg_hdr);
+
+			if (!rx) {
+				js->no_tstamp++;
+				rx = realtime_ns();
+			}
+			total += mmsg_hdr[pkt].msg_len;
+			jitter_pkt(js, p, msg_iov[pkt].iov_base,
+				   mmsg_hdr[pkt].msg_len, rx);
+			touch_payload(p, msg_iov[pkt].iov_base,
+				      mmsg_hdr[pkt].msg_len);
+		}
+		cnt += res;
+	}
+	if (js->have_prev)
+		jitter_burst_end(js);
+	r->bytes = total;
+	p->js = js; /* printed and freed by print_jitter_result() */
+
+	for (pkt = 0; pkt < p->batch; pkt++)
+		free(msg_iov[pkt].iov_base);
+	free(msg_iov);
+	free(mmsg_hdr);
+	return cnt - r->try_again;
+
+ error:
+	fprintf(stderr, "ERROR: %s() failed (%d) errno(%d) ",
+		__func__, res, errno);
+	perror("- recvmmsg");
+	close(sockfd);
+	exit(EXIT_FAIL_SOCK);
+}
+
+/*
+ * Event loop: epoll_wait for readability, then drain the socket with
+ * recvmmsg.  Latency is from kernel receive timestamp to userspace,
+ * which includes the wakeup cost that busy polling is meant to avoid.
+ */
+static int sink_with_epoll(int sockfd, struct sink_params *p,
+			   struct time_bench_record *r) {
+	int cnt, res, pkt, epfd, n;
+	uint64_t total = 0, wakeups = 0;
+	int tmo = p->timeout >= 0 ? p->timeout * 1000 : -1;
+	char cbuf[p->batch][CMSG_SPACE(sizeof(struct timespec))];
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct iovec *msg_iov;
+	struct mmsghdr *mmsg_hdr;
+	struct histogram *lat;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("- epoll_create1");
+		exit(EXIT_FAIL_SOCK);
+	}
+	ev.data.fd = sockfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+		perror("- epoll_ctl");
+		exit(EXIT_FAIL_SOCK);
+	}
+	if (p->epoll_busy_poll) {
+		struct epoll_params epp = {
+			.busy_poll_usecs  = p->epoll_busy_poll,
+			.busy_poll_budget = p->busy_poll_budget,
+			.prefer_busy_poll = p->prefer_busy_poll,
+		};
+
+		if (ioctl(epfd, EPIOCSPARAMS, &epp) < 0) {
+			printf("ERROR: No support for EPIOCSPARAMS\n");
+			perror("- ioctl(EPIOCSPARAMS)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	lat = rx_lat_alloc();
+
+	mmsg_hdr = malloc_mmsghdr(p->batch);
+	msg_iov  = malloc_iovec(p->batch);
+	for (pkt = 0; pkt < p->batch; pkt++) {
+		msg_iov[pkt].iov_base = malloc_payload_buffer(p->buf_sz);
+		msg_iov[pkt].iov_len  = p->buf_sz;
+		mmsg_hdr[pkt].msg_hdr.msg_iov    = &msg_iov[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (cnt = 0; cnt < p->count; ) {
+		uint64_t now;
+
+		n = epoll_wait(epfd, &ev, 1, tmo);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			res = n;
+			goto error;
+		}
+		if (n == 0) {
+			fprintf(stderr, "ERROR: %s() timeout\n", __func__);
+			break;
+		}
+		wakeups++;
+
+		for (pkt = 0; pkt < p->batch; pkt++) {
+			mmsg_hdr[pkt].msg_hdr.msg_control    = cbuf[pkt];
+			mmsg_hdr[pkt].msg_hdr.msg_controllen = sizeof(cbuf[pkt]);
+		}
+		res = recvmmsg(sockfd, mmsg_hdr, p->batch, MSG_DONTWAIT, NULL);
+		if (res < 0) {
+			if (errno == EAGAIN) {
+				r->try_again++; /* spurious wakeup */
+				continue;
+			}
+			goto error;
+		}
+		now = realtime_ns();
+		for (pkt = 0; pkt < res; pkt++) {
+			rx_lat_add(lat, &mmsg_hdr[pkt].msg_hdr, now);
+			touch_payload(p, msg_iov[pkt].iov_base,
+				      mmsg_hdr[pkt].msg_len);
+			total += mmsg_hdr[pkt].msg_len;
+		}
+		cnt += res;
+	}
+	r->bytes = total;
+	if (verbose > 0)
+		printf(" - epoll wakeups %lu = %.1f pkts/wakeup"
+		       " (spurious %lu)\n", wakeups,
+		       wakeups ? (double)cnt / wakeups : 0.0, r->try_again);
+	p->rx_lat = lat; /* printed and freed by print_latency_result() */
+
+	for (pkt = 0; pkt < p->batch; pkt++)
+		free(msg_iov[pkt].iov_base);
+	free(msg_iov);
+	free(mmsg_hdr);
+	close(epfd);
+	return cnt;
+
+ error:
+	fprintf(stderr, "ERROR: %s() failed (%d) errno(%d) ",
+		__func__, res, errno);
+	perror("- epoll recvmmsg");
+	close(sockfd);
+	exit(EXIT_FAIL_SOCK);
+}
+
+static void print_latency_result(struct sink_params *p)
+{
+	if (!p->rx_lat)
+		return;
+	histogram_print_summary(p->rx_lat, "kernel-to-user latency", "ns");
+	free(p->rx_lat);
+	p->rx_lat = NULL;
+}
+
+static inline double tv_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* CPU usage of this process relative to wall time of the run, busy
+ * polling trades CPU cycles for latency.
+ */
+static void print_cpu_usage(struct rusage *start, struct rusage *stop,
+			    struct time_bench_record *r)
+{
+	double wall = r->timesec;
+	double usr = tv_sec(&stop->ru_utime) - tv_sec(&start->ru_utime);
+	double sys = tv_sec(&stop->ru_stime) - tv_sec(&start->ru_stime);
+
+	if (wall <= 0)
+		return;
+	printf(" - cpu: usr %.1f%% sys %.1f%% (wall %.2f sec)"
+	       " ctx-switch vol %ld invol %ld\n",
+	       usr * 100 / wall, sys * 100 / wall, wall,
+	       stop->ru_nvcsw - start->ru_nvcsw,
+	       stop->ru_nivcsw - start->ru_nivcsw);
+}
+
 static void init_stats(struct sink_params *params, unsigned int testrun)
 {
 	/* Params also contain some stats the need reset between runs.
@@ -674,12 +1335,120 @@ static void init_stats(struct sink_params *params, unsigned int testrun)
 	params->run_flag_curr	= testrun;
 }
 
+/* Running sums for mean and variance of ns/pkt samples */
+struct ab_sample {
+	int n;
+	double sum;
+	double sumsq;
+};
+
+static void ab_add(struct ab_sample *s, double v)
+{
+	s->n++;
+	s->sum += v;
+	s->sumsq += v * v;
+}
+
+static double ab_mean(struct ab_sample *s)
+{
+	return s->n ? s->sum / s->n : 0;
+}
+
+static double ab_var(struct ab_sample *s)
+{
+	double mean = ab_mean(s);
+
+	if (s->n < 2)
+		return 0;
+	return (s->sumsq - s->n * mean * mean) / (s->n - 1);
+}
+
+/* Two-sided 95% quantile of Student's t distribution */
+static double student_t95(double df)
+{
+	static const double t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571,
+		2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145,
+		2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069,
+		2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	int i = (int)df;
+
+	if (i < 1)
+		i = 1;
+	if (i <= 30)
+		return t[i];
+	return 1.960;
+}
+
+/* ABBA order: on,off,off,on,on,off,... pairs swap which goes first */
+static int demux_ab_setting(int run)
+{
+	int first = ((run / 2) % 2) == 0;
+
+	return (run % 2) ? !first : first;
+}
+
+static void demux_set(int value)
+{
+	if (write_proc_int(PROC_IP_EARLY_DEMUX, value) < 0 ||
+	    write_proc_int(PROC_UDP_EARLY_DEMUX, value) < 0)
+		exit(EXIT_FAIL_FILEACCESS);
+}
+
+/* Added cost per packet of each touch mode, relative to first mode */
+static void print_touch_result(struct sink_params *p, struct ab_sample *ns,
+			       int *modes, int nr_modes)
+{
+	double base = ab_mean(&ns[modes[0]]);
+	int i, m;
+
+	for (i = 0; i < nr_modes; i++) {
+		m = modes[i];
+		printf(" - touch %-8s: %.2f ns/pkt", touch_names[m],
+		       ab_mean(&ns[m]));
+		if (i > 0)
+			printf(" (%+.2f ns/pkt vs %s)", ab_mean(&ns[m]) - base,
+			       touch_names[modes[0]]);
+		printf("\n");
+	}
+	if (verbose)
+		printf(" - touch sum:0x%llx\n",
+		       (unsigned long long)p->touch_sum);
+}
+
+/* Welch's t-test confidence interval for the mean difference */
+static void print_demux_ab(struct ab_sample *on, struct ab_sample *off)
+{
+	double va = ab_var(on) / on->n, vb = ab_var(off) / off->n;
+	double delta = ab_mean(off) - ab_mean(on);
+	double se = sqrt(va + vb);
+	double df, ci;
+
+	/* Welch-Satterthwaite degrees of freedom */
+	if (va + vb > 0 && on->n > 1 && off->n > 1)
+		df = (va + vb) * (va + vb) /
+			(va * va / (on->n - 1) + vb * vb / (off->n - 1));
+	else
+		df = 1;
+	ci = student_t95(df) * se;
+
+	printf(" - demux A/B: on %.2f ns/pkt (n:%d sd:%.2f)"
+	       " off %.2f ns/pkt (n:%d sd:%.2f)\n",
+	       ab_mean(on), on->n, sqrt(ab_var(on)),
+	       ab_mean(off), off->n, sqrt(ab_var(off)));
+	printf(" - demux A/B: off-on delta %+.2f ns/pkt"
+	       " 95%% CI [%+.2f, %+.2f] (%.1f%%)%s\n",
+	       delta, delta - ci, delta + ci,
+	       ab_mean(on) ? delta * 100 / ab_mean(on) : 0.0,
+	       (fabs(delta) > ci) ? " significant" : "");
+}
+
 static void time_function(int sockfd, struct sink_params *p, const char *name,
 			  int (*func)(int sockfd, struct sink_params *p,
 				      struct time_bench_record *r))
 {
 	char from_ip[INET6_ADDRSTRLEN] = {0}; /* Assume max IPv6 */
 	struct time_bench_record rec = {0};
+	struct rusage ru_start, ru_stop;
 	int str_max = sizeof(from_ip);
 	int cnt_recv, j;
 	#define TMPMAX 4096
@@ -697,6 +1466,10 @@ static void time_function(int sockfd, struct sink_params *p, const char *name,
 	__be16 src_port = 0;
 	void *addr_ptr = NULL;
 	int flags = 0;
+	struct ab_sample ab[2] = { { 0 } };
+	int orig_ip_demux = 0, orig_udp_demux = 0;
+	int none = TOUCH_NONE, *modes = &none, nr_modes = 1, m, run;
+	struct ab_sample touch_ns[TOUCH_MAX] = { { 0 } };
 
 	/* WAIT on first packet of flood */
 	if (verbose)
@@ -744,20 +1517,43 @@ static void time_function(int sockfd, struct sink_params *p, const char *name,
 		printf("  * Got first packet (starting timing)\n");
 	}
 
-	for (j = 0; j < p->repeat; j++) {
+	if (p->demux_ab) {
+		orig_ip_demux  = read_proc_int(PROC_IP_EARLY_DEMUX);
+		orig_udp_demux = read_proc_int(PROC_UDP_EARLY_DEMUX);
+	}
+
+	/* Each touch mode get its own set of repeat runs */
+	if (p->nr_touch) {
+		modes = p->touch_order;
+		nr_modes = p->nr_touch;
+	}
+
+	for (j = 0; j < p->repeat * nr_modes; j++) {
+		run = j % p->repeat;
+		m = modes[j / p->repeat];
+		if (run == 0 && p->touch_modes) {
+			p->touch = m;
+			printf(" - touch mode: %s\n", touch_names[m]);
+		}
+		if (p->demux_ab)
+			demux_set(demux_ab_setting(run));
 		if (verbose) {
 			printf(" Test run: %d (expecting to receive %d pkts)\n",
-			       j, p->count);
+			       run, p->count);
 		} else {
-			int b = (p->run_flag_curr & RUN_RECVMMSG) ? p->batch:0;
+			int b = (p->run_flag_curr &
+				 (RUN_RECVMMSG | RUN_JITTER | RUN_EPOLL)) ?
+				p->batch : 0;
 			print_header(name, b);
-			printf("run: %2d\t", j);
+			printf("run: %2d\t", run);
 		}
 
 		time_bench_record_setting(&rec);
+		getrusage(RUSAGE_SELF, &ru_start);
 		time_bench_start(&rec);
 		cnt_recv = func(sockfd, p, &rec);
 		time_bench_stop(&rec);
+		getrusage(RUSAGE_SELF, &ru_stop);
 
 		if (cnt_recv < 0) {
 			fprintf(stderr, "ERROR: failed to recv packets\n");
@@ -768,9 +1564,28 @@ static void time_function(int sockfd, struct sink_params *p, const char *name,
 		time_bench_calc_stats(&rec);
 		time_bench_print_stats(&rec, &p->c);
 		print_check_result(p);
+		print_jitter_result(p);
+		print_latency_result(p);
+		if (p->demux_ab)
+			ab_add(&ab[demux_ab_setting(run)], rec.ns_per_pkt);
+		ab_add(&touch_ns[m], rec.ns_per_pkt);
+		if (verbose || p->busy_poll || p->epoll_busy_poll ||
+		    (p->run_flag_curr & RUN_EPOLL))
+			print_cpu_usage(&ru_start, &ru_stop, &rec);
 		init_stats(p, p->run_flag_curr);
 	}
 
+	if (p->demux_ab) {
+		print_demux_ab(&ab[1], &ab[0]);
+		if (orig_ip_demux >= 0)
+			write_proc_int(PROC_IP_EARLY_DEMUX, orig_ip_demux);
+		if (orig_udp_demux >= 0)
+			write_proc_int(PROC_UDP_EARLY_DEMUX, orig_udp_demux);
+	}
+	if (p->touch_modes)
+		print_touch_result(p, touch_ns, modes, nr_modes);
+	p->touch = TOUCH_NONE;
+
 	return;
 
 socket_error:
@@ -821,22 +1636,441 @@ static void init_params(struct sink_params *params)
 	params->iov_elems = 1;
 	params->buf_sz = 4096;
 	params->run_flag = 0;
+	params->nr_ports = 1;
+	params->workers = 1;
+	params->budget = 256;
+	params->conn_sport = 20000;
 }
 
-int main(int argc, char *argv[])
+static int setup_socket(struct sink_params *p, int addr_family,
+			uint16_t listen_port)
 {
 	struct sockaddr_storage listen_addr; /* Can contain both sockaddr_in and sockaddr_in6 */
+	int sockfd;
+	int on = 1;
+
+	/* Socket setup stuff */
+	sockfd = Socket(addr_family, SOCK_DGRAM, p->lite ? IPPROTO_UDPLITE :
+			IPPROTO_UDP);
+
+	/* Connected sockets share the local port with the wildcard */
+	if (p->conn_socks)
+		Setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	/* Enable use of SO_REUSEPORT for multi-process testing  */
+	if (p->so_reuseport) {
+		if ((setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				&p->so_reuseport, sizeof(p->so_reuseport))) < 0) {
+			    printf("ERROR: No support for SO_REUSEPORT\n");
+			    perror("- setsockopt(SO_REUSEPORT)");
+			    exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	/* Enable BPF filtering to distribute the ingress packets among the
+	 * SO_REUSEPORT sockets
+	 */
+	if (p->use_bpf && enable_bpf(sockfd)) {
+		printf("ERROR: No support for SO_ATTACH_REUSEPORT_CBPF\n");
+		perror("- setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		exit(EXIT_FAIL_SOCKOPT);
+	}
+
+	/* enable the requested ancillary messages */
+	if (p->recv_pktinfo) {
+		if (setsockopt(sockfd, SOL_IP, IP_PKTINFO, &on, sizeof(on)) < 0) {
+			printf("ERROR: No support for IP_PKTINFO\n");
+			perror("- setsockopt(IP_PKTINFO)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	if (p->recv_ttl) {
+		if (setsockopt(sockfd, SOL_IP, IP_RECVTTL, &on, sizeof(on)) < 0) {
+			printf("ERROR: No support for IP_RECVTTL\n");
+			perror("- setsockopt(IP_RECVTTL)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	/* Busy poll the device queue from the socket, instead of
+	 * waiting for the softirq to deliver the packet
+	 */
+	if (p->busy_poll) {
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &p->busy_poll,
+			       sizeof(p->busy_poll)) < 0) {
+			printf("ERROR: No support for SO_BUSY_POLL\n");
+			perror("- setsockopt(SO_BUSY_POLL)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+	if (p->prefer_busy_poll) {
+		if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on,
+			       sizeof(on)) < 0) {
+			printf("ERROR: No support for SO_PREFER_BUSY_POLL\n");
+			perror("- setsockopt(SO_PREFER_BUSY_POLL)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+	if (p->busy_poll_budget) {
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+			       &p->busy_poll_budget,
+			       sizeof(p->busy_poll_budget)) < 0) {
+			printf("ERROR: No support for SO_BUSY_POLL_BUDGET\n");
+			perror("- setsockopt(SO_BUSY_POLL_BUDGET)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	/* Kernel RX timestamps, for jitter and latency analysis */
+	if ((p->run_flag & (RUN_JITTER | RUN_EPOLL)) || p->busy_poll) {
+		if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+			       sizeof(on)) < 0) {
+			printf("ERROR: No support for SO_TIMESTAMPNS\n");
+			perror("- setsockopt(SO_TIMESTAMPNS)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	/* Setup listen_addr depending on IPv4 or IPv6 address */
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	if (addr_family == AF_INET) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)&listen_addr;
+		addr4->sin_family = addr_family;
+		addr4->sin_port   = htons(listen_port);
+	} else if (addr_family == AF_INET6) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&listen_addr;
+		addr6->sin6_family= addr_family;
+		addr6->sin6_port  = htons(listen_port);
+	}
+
+	Bind(sockfd, &listen_addr);
+
+	if (p->sk_timeout >= 0) {
+		struct timeval tv = { p->sk_timeout, 0 };
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			       sizeof(tv)) < 0) {
+			perror("- setsockopt(SO_RCVTIMEO)");
+			exit(EXIT_FAIL_SOCKOPT);
+		}
+	}
+
+	return sockfd;
+}
+
+/*
+ * Many port fan-in: all sockets are registered with the epoll
+ * instance of every worker.  A wakeup is an epoll_wait return with
+ * events, each ready socket is drained with recvmmsg up to budget.
+ */
+struct fanin_worker {
+	pthread_t thread;
+	int id;
+	int epfd;
+	struct sink_params *p;
+	/* stats */
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t wakeups;
+	uint64_t events;
+	uint64_t empty;		/* event, but nothing to recv */
+	uint64_t budget_hit;	/* socket had more than budget */
+	uint64_t wildcard;	/* pkts on fanin_wildcard socket */
+};
+
+static volatile int fanin_stop;
+static int fanin_wildcard = -1;
+static uint64_t fanin_packets;	/* total over workers */
+static uint64_t fanin_start;	/* first pkt, ns */
+static uint64_t fanin_stop_ns;	/* count reached, ns */
+static uint64_t fanin_stop_pkts; /* total when count reached */
+
+#define FANIN_EVENTS 64
+
+static void *fanin_worker(void *arg)
+{
+	struct fanin_worker *w = arg;
+	struct sink_params *p = w->p;
+	struct epoll_event events[FANIN_EVENTS];
+	struct mmsghdr *mmsg_hdr;
+	struct iovec *msg_iov;
+	int i, n, pkt, res;
+	uint64_t total;
+
+	mmsg_hdr = malloc_mmsghdr(p->batch);
+	msg_iov  = malloc_iovec(p->batch);
+	for (pkt = 0; pkt < p->batch; pkt++) {
+		msg_iov[pkt].iov_base = malloc_payload_buffer(p->buf_sz);
+		msg_iov[pkt].iov_len  = p->buf_sz;
+		mmsg_hdr[pkt].msg_hdr.msg_iov    = &msg_iov[pkt];
+		mmsg_hdr[pkt].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!fanin_stop) {
+		/* Timeout to notice fanin_stop, when other worker finish */
+		n = epoll_wait(w->epfd, events, FANIN_EVENTS, 100);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("- epoll_wait");
+			exit(EXIT_FAIL_SOCK);
+		}
+		if (n == 0)
+			continue;
+		w->wakeups++;
+		w->events += n;
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			int drained = 0;
+
+			while (drained < p->budget) {
+				int vlen = p->budget - drained;
+
+				if (vlen > p->batch)
+					vlen = p->batch;
+				res = recvmmsg(fd, mmsg_hdr, vlen,
+					       MSG_DONTWAIT, NULL);
+				if (res < 0) {
+					if (errno == EAGAIN)
+						break;
+					perror("- recvmmsg");
+					exit(EXIT_FAIL_SOCK);
+				}
+				for (pkt = 0; pkt < res; pkt++)
+					w->bytes += mmsg_hdr[pkt].msg_len;
+				drained += res;
+				if (res < vlen)
+					break;
+			}
+			if (!drained) {
+				w->empty++;
+				continue;
+			}
+			if (drained >= p->budget)
+				w->budget_hit++;
+			w->packets += drained;
+			if (fd == fanin_wildcard)
+				w->wildcard += drained;
+			if (!fanin_start)
+				__sync_val_compare_and_swap(&fanin_start, 0,
+							    gettime());
+			total = __sync_add_and_fetch(&fanin_packets, drained);
+			/* Worker crossing count records stop time, as
+			 * idle workers only notice fanin_stop on timeout
+			 */
+			if (total >= p->count && total - drained < p->count) {
+				fanin_stop_ns = gettime();
+				fanin_stop_pkts = total;
+				fanin_stop = 1;
+			}
+		}
+	}
+
+	for (pkt = 0; pkt < p->batch; pkt++)
+		free(msg_iov[pkt].iov_base);
+	free(msg_iov);
+	free(mmsg_hdr);
+	return NULL;
+}
+
+static void fanin_loop(struct sink_params *p, int *fds, int nr_fds)
+{
+	struct fanin_worker *w;
+	uint64_t stop, packets, wakeups, events, wildcard, rate_pkts;
+	double sec;
+	int i, j, run;
+
+	w = calloc(p->workers, sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+
+	for (j = 0; j < p->workers; j++) {
+		w[j].id = j;
+		w[j].p = p;
+		w[j].epfd = epoll_create1(0);
+		if (w[j].epfd < 0) {
+			perror("- epoll_create1");
+			exit(EXIT_FAIL_SOCK);
+		}
+		for (i = 0; i < nr_fds; i++) {
+			struct epoll_event ev = {
+				.events  = EPOLLIN |
+					   (p->exclusive ? EPOLLEXCLUSIVE : 0),
+				.data.fd = fds[i],
+			};
+
+			if (epoll_ctl(w[j].epfd, EPOLL_CTL_ADD, fds[i],
+				      &ev) < 0) {
+				perror("- epoll_ctl");
+				exit(EXIT_FAIL_SOCK);
+			}
+		}
+	}
+
+	for (run = 0; run < p->repeat; run++) {
+		fanin_stop = 0;
+		fanin_packets = 0;
+		fanin_start = 0;
+		fanin_stop_ns = 0;
+		for (j = 0; j < p->workers; j++) {
+			w[j].packets = w[j].bytes = w[j].wakeups = 0;
+			w[j].events = w[j].empty = w[j].budget_hit = 0;
+			w[j].wildcard = 0;
+			if (pthread_create(&w[j].thread, NULL, fanin_worker,
+					   &w[j])) {
+				perror("- pthread_create");
+				exit(EXIT_FAIL_PTHREAD);
+			}
+		}
+		packets = wakeups = events = wildcard = 0;
+		for (j = 0; j < p->workers; j++) {
+			pthread_join(w[j].thread, NULL);
+			packets += w[j].packets;
+			wakeups += w[j].wakeups;
+			events  += w[j].events;
+			wildcard += w[j].wildcard;
+		}
+		stop = fanin_stop_ns ? fanin_stop_ns : gettime();
+		sec = (stop - fanin_start) / 1000000000.0;
+		if (sec <= 0)
+			sec = 1;
+		/* Pkts drained by other workers after stop not in rate */
+		rate_pkts = fanin_stop_ns ? fanin_stop_pkts : packets;
+
+		printf("fan-in run:%d socks:%d workers:%d%s pkts:%lu"
+		       " pps:%.0f wakeups/sec:%.0f pkts/wakeup:%.1f"
+		       " events/wakeup:%.1f\n", run, nr_fds,
+		       p->workers, p->exclusive ? " exclusive" : "",
+		       packets, rate_pkts / sec, wakeups / sec,
+		       wakeups ? (double)packets / wakeups : 0.0,
+		       wakeups ? (double)events / wakeups : 0.0);
+		if (fanin_wildcard >= 0)
+			printf(" - connected socks:%d hit:%lu wildcard:%lu\n",
+			       nr_fds - 1, packets - wildcard, wildcard);
+		for (j = 0; verbose && j < p->workers; j++)
+			printf(" - worker:%d pkts:%lu bytes:%lu wakeups:%lu"
+			       " events:%lu empty:%lu budget-hit:%lu\n",
+			       j, w[j].packets, w[j].bytes, w[j].wakeups,
+			       w[j].events, w[j].empty, w[j].budget_hit);
+	}
+
+	for (j = 0; j < p->workers; j++)
+		close(w[j].epfd);
+	free(w);
+}
+
+static int run_fanin(struct sink_params *p, int addr_family,
+		     uint16_t listen_port)
+{
+	int *fds;
+	int i;
+
+	fds = calloc(p->nr_ports, sizeof(*fds));
+	if (!fds) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	raise_nofile_limit(p->nr_ports + 64);
+	for (i = 0; i < p->nr_ports; i++)
+		fds[i] = setup_socket(p, addr_family, listen_port + i);
+
+	if (verbose)
+		printf("Fan-in ports %d-%d workers %d%s budget %d batch %d\n",
+		       listen_port, listen_port + p->nr_ports - 1,
+		       p->workers, p->exclusive ? " (EPOLLEXCLUSIVE)" : "",
+		       p->budget, p->batch);
+	fanin_loop(p, fds, p->nr_ports);
+
+	for (i = 0; i < p->nr_ports; i++)
+		close(fds[i]);
+	free(fds);
+	return 0;
+}
+
+/*
+ * Many connected sockets bound to the same local port, the kernel
+ * UDP lookup must find the socket matching the 4-tuple among all
+ * sockets in the port hash slot.  fds[0] is the wildcard socket,
+ * receiving anything not matching a connected socket.
+ */
+static int run_connected(struct sink_params *p, int addr_family,
+			 uint16_t listen_port)
+{
+	struct sockaddr_storage peer;
+	int nr = p->conn_socks + 1;
+	int *fds;
+	int i;
+
+	fds = calloc(nr, sizeof(*fds));
+	if (!fds) {
+		fprintf(stderr, "ERROR: %s() malloc failed\n", __func__);
+		exit(EXIT_FAIL_MEM);
+	}
+	raise_nofile_limit(nr + 64);
+	for (i = 0; i < nr; i++) {
+		fds[i] = setup_socket(p, addr_family, listen_port);
+		if (i == 0)
+			continue;
+		setup_sockaddr(addr_family, &peer, p->conn_peer,
+			       p->conn_sport + i - 1);
+		Connect(fds[i], (struct sockaddr *)&peer, sockaddr_len(&peer));
+	}
+	fanin_wildcard = fds[0];
+
+	if (verbose)
+		printf("Connected socks %d on port %d peer %s ports %d-%d"
+		       " workers %d\n", p->conn_socks, listen_port,
+		       p->conn_peer, p->conn_sport,
+		       p->conn_sport + p->conn_socks - 1, p->workers);
+	fanin_loop(p, fds, nr);
+
+	for (i = 0; i < nr; i++)
+		close(fds[i]);
+	free(fds);
+	return 0;
+}
+
+/* Parse comma separated list of touch modes, e.g. "none,copy" */
+static int parse_touch_modes(struct sink_params *p, char *arg)
+{
+	char *tok, *save = NULL;
+	int m;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (m = 0; m < TOUCH_MAX; m++)
+			if (!strcmp(tok, touch_names[m]))
+				break;
+		if (m == TOUCH_MAX) {
+			fprintf(stderr, "ERROR: unknown --touch mode: %s\n",
+				tok);
+			return -1;
+		}
+		if (p->touch_modes & (1 << m))
+			continue;
+		p->touch_modes |= 1 << m;
+		p->touch_order[p->nr_touch++] = m;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
 	uint16_t listen_port = 6666;
 	int addr_family = AF_INET; /* Default address family */
+	int touch_ring_kb = TOUCH_RING_KB;
 	struct sink_params p;
 	int longindex = 0;
 	int sockfd, c;
-	int on = 1;
 
 	init_params(&p);
 
 	/* Parse commands line args */
-	while ((c = getopt_long(argc, argv, "hc:r:l:64Oi:I:LdsCS:B:v:tTuUb:",
+	while ((c = getopt_long(argc, argv, "hc:r:l:64Oi:I:LdsCS:B:v:tTuUb:E",
 				long_options, &longindex)) != -1) {
 		if (c == 0) {
 			/* handle options without short version */
@@ -854,6 +2088,47 @@ int main(int argc, char *argv[])
 				p.use_bpf = true;
 			if (!strcmp(long_options[longindex].name, "recv-ttl"))
 				p.recv_ttl = 1;
+			if (!strcmp(long_options[longindex].name, "jitter"))
+				p.run_flag |= RUN_JITTER;
+			if (!strcmp(long_options[longindex].name, "interval"))
+				p.interval = strtoul(optarg, NULL, 0);
+			if (!strcmp(long_options[longindex].name, "burst"))
+				p.burst = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "busy-poll"))
+				p.busy_poll = atoi(optarg);
+			if (!strcmp(long_options[longindex].name,
+				    "prefer-busy-poll"))
+				p.prefer_busy_poll = 1;
+			if (!strcmp(long_options[longindex].name,
+				    "busy-poll-budget"))
+				p.busy_poll_budget = atoi(optarg);
+			if (!strcmp(long_options[longindex].name,
+				    "epoll-busy-poll"))
+				p.epoll_busy_poll = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "ports"))
+				p.nr_ports = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "workers"))
+				p.workers = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "exclusive"))
+				p.exclusive = 1;
+			if (!strcmp(long_options[longindex].name, "budget"))
+				p.budget = atoi(optarg);
+			if (!strcmp(long_options[longindex].name,
+				    "conn-socks"))
+				p.conn_socks = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "conn-peer"))
+				p.conn_peer = optarg;
+			if (!strcmp(long_options[longindex].name,
+				    "conn-sport"))
+				p.conn_sport = atoi(optarg);
+			if (!strcmp(long_options[longindex].name, "demux-ab"))
+				p.demux_ab = 1;
+			if (!strcmp(long_options[longindex].name, "touch"))
+				if (parse_touch_modes(&p, optarg) < 0)
+					return usage(argv);
+			if (!strcmp(long_options[longindex].name,
+				    "touch-ring"))
+				touch_ring_kb = atoi(optarg);
 		}
 		if (c == 'c') p.count     = atoi(optarg);
 		if (c == 'r') p.repeat    = atoi(optarg);
@@ -877,6 +2152,7 @@ int main(int argc, char *argv[])
 		if (c == 't') p.run_flag   |= RUN_RECVFROM;
 		if (c == 'T') p.run_flag   |= RUN_READ;
 		if (c == 176) p.run_flag   |= RUN_RECV;
+		if (c == 'E') p.run_flag   |= RUN_EPOLL;
 		if (c == 'h' || c == '?') return usage(argv);
 	}
 
@@ -886,69 +2162,38 @@ int main(int argc, char *argv[])
 	if (p.run_flag == 0)
 		p.run_flag = RUN_ALL;
 
-	/* Socket setup stuff */
-	sockfd = Socket(addr_family, SOCK_DGRAM, p.lite ? IPPROTO_UDPLITE :
-			IPPROTO_UDP);
-
-	/* Enable use of SO_REUSEPORT for multi-process testing  */
-	if (p.so_reuseport) {
-		if ((setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
-				&p.so_reuseport, sizeof(p.so_reuseport))) < 0) {
-			    printf("ERROR: No support for SO_REUSEPORT\n");
-			    perror("- setsockopt(SO_REUSEPORT)");
-			    exit(EXIT_FAIL_SOCKOPT);
+	if (p.touch_modes & (1 << TOUCH_COPY)) {
+		if (touch_ring_kb < 64)
+			touch_ring_kb = 64; /* room for max UDP payload */
+		p.touch_ring_sz = (size_t)touch_ring_kb * 1024;
+		/* Cache line aligned base, slot offsets are aligned too */
+		if (posix_memalign((void **)&p.touch_ring, CACHE_LINE_SZ,
+				   p.touch_ring_sz)) {
+			fprintf(stderr, "ERROR: --touch-ring %d KB alloc"
+				" failed\n", touch_ring_kb);
+			return EXIT_FAIL_MEM;
 		}
+		memset(p.touch_ring, 0, p.touch_ring_sz);
 	}
 
-	/* Enable BPF filtering to distribute the ingress packets among the
-	 * SO_REUSEPORT sockets
-	 */
-	if (p.use_bpf && enable_bpf(sockfd)) {
-		printf("ERROR: No support for SO_ATTACH_REUSEPORT_CBPF\n");
-		perror("- setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
-		exit(EXIT_FAIL_SOCKOPT);
+	/* Need at least two samples of each setting, in ABBA order */
+	if (p.demux_ab && p.repeat < 4) {
+		p.repeat = 8;
+		if (verbose)
+			printf("A/B demux test, using --repeat %d\n", p.repeat);
 	}
 
-	/* enable the requested ancillary messages */
-	if (p.recv_pktinfo) {
-		if (setsockopt(sockfd, SOL_IP, IP_PKTINFO, &on, sizeof(on)) < 0) {
-			printf("ERROR: No support for IP_PKTINFO\n");
-			perror("- setsockopt(IP_PKTINFO)");
-			exit(EXIT_FAIL_SOCKOPT);
+	if (p.conn_socks > 0) {
+		if (!p.conn_peer) {
+			fprintf(stderr, "ERROR: --conn-socks needs --conn-peer\n");
+			return usage(argv);
 		}
+		return run_connected(&p, addr_family, listen_port);
 	}
+	if (p.nr_ports > 1)
+		return run_fanin(&p, addr_family, listen_port);
 
-	if (p.recv_ttl) {
-		if (setsockopt(sockfd, SOL_IP, IP_RECVTTL, &on, sizeof(on)) < 0) {
-			printf("ERROR: No support for IP_RECVTTL\n");
-			perror("- setsockopt(IP_RECVTTL)");
-			exit(EXIT_FAIL_SOCKOPT);
-		}
-	}
-
-	/* Setup listen_addr depending on IPv4 or IPv6 address */
-	memset(&listen_addr, 0, sizeof(listen_addr));
-	if (addr_family == AF_INET) {
-		struct sockaddr_in *addr4 = (struct sockaddr_in *)&listen_addr;
-		addr4->sin_family = addr_family;
-		addr4->sin_port   = htons(listen_port);
-	} else if (addr_family == AF_INET6) {
-		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&listen_addr;
-		addr6->sin6_family= addr_family;
-		addr6->sin6_port  = htons(listen_port);
-	}
-
-	Bind(sockfd, &listen_addr);
-
-	if (p.sk_timeout >= 0) {
-		struct timeval tv = { p.sk_timeout, 0 };
-
-		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
-			       sizeof(tv)) < 0) {
-			perror("- setsockopt(SO_RCVTIMEO)");
-			exit(EXIT_FAIL_SOCKOPT);
-		}
-	}
+	sockfd = setup_socket(&p, addr_family, listen_port);
 
 	if (!verbose)
 		printf("%-10s\t%-8s %-8s\tns/pkt\tpps\t\tcycles\tpayload\n",
@@ -980,6 +2225,16 @@ int main(int argc, char *argv[])
 		time_function(sockfd, &p, "recv", sink_with_recv);
 	}
 
+	if (p.run_flag       & RUN_JITTER) {
+		init_stats(&p, RUN_JITTER);
+		time_function(sockfd, &p, "jitter", sink_with_jitter);
+	}
+
+	if (p.run_flag       & RUN_EPOLL) {
+		init_stats(&p, RUN_EPOLL);
+		time_function(sockfd, &p, "epoll", sink_with_epoll);
+	}
+
 	close(sockfd);
 	return 0;
 }
@@ -0,0 +1,189 @@
+#!/bin/bash
+#
+# Setup a qdisc that honors SO_TXTIME launch times, for testing the
+# udp_pacer --txtime mode (see src/udp_pacer.c).
+#
+# Two qdiscs support SCM_TXTIME stamped packets:
+#  - ETF (Earliest TxTime First) requires clockid CLOCK_TAI
+#  - FQ (Fair Queue) uses CLOCK_MONOTONIC as its time reference
+#
+# Without a NIC, the device can be created as a dummy or veth device.
+#
+# Author: Jesper Dangaard Brouer <netoptimizer@brouer.com>
+# License: GPLv2
+#
+basedir=`dirname $0`
+source ${basedir}/functions.sh
+
+export TC=/sbin/tc
+
+root_check_run_with_sudo "$@"
+
+function usage() {
+    echo ""
+    echo "Usage: $0 [-vh] --dev ethX [--etf|--fq]"
+    echo "  -d | --dev     : (\$DEV)       Interface/device (required)"
+    echo "  --etf          : (\$QDISC)     Use ETF qdisc, CLOCK_TAI (default)"
+    echo "  --fq           : (\$QDISC)     Use FQ qdisc, CLOCK_MONOTONIC"
+    echo "  --delta NSEC   : (\$DELTA)     ETF delta, dequeue ahead of txtime"
+    echo "  --offload      : (\$OFFLOAD)   ETF offload to NIC (launch time HW)"
+    echo "  --dummy        : (\$CREATE)    Create device as dummy device"
+    echo "  --veth         : (\$CREATE)    Create device as veth pair (\$DEV-peer)"
+    echo "  --ip IPADDR/N  : (\$IPADDR)    Assign IP-addr to created device"
+    echo "  -f | --flush   : (\$FLUSH)     Only flush (remove qdisc/device)"
+    echo "  --dry-run      : (\$DRYRUN)    Dry-run only (echo tc commands)"
+    echo "  -v | --verbose : (\$VERBOSE)   verbose"
+    echo ""
+}
+
+# Using external program "getopt" to get --long-options
+OPTIONS=$(getopt -o vfhd: \
+    --long verbose,dry-run,flush,help,etf,fq,offload,dummy,veth,dev:,delta:,ip: -- "$@")
+if (( $? != 0 )); then
+    usage
+    err 2 "Error calling getopt"
+fi
+eval set -- "$OPTIONS"
+
+QDISC=etf
+DELTA=200000
+
+##  --- Parse command line arguments / parameters ---
+while true; do
+    case "$1" in
+        -d | --dev ) # device
+          export DEV=$2
+	  info "Device set to: DEV=$DEV" >&2
+	  shift 2
+          ;;
+        -v | --verbose)
+          export VERBOSE=yes
+	  shift
+          ;;
+        --dry-run )
+          export DRYRUN=yes
+          export VERBOSE=yes
+          info "Dry-run mode: enable VERBOSE and don't call TC" >&2
+	  shift
+          ;;
+        -f | --flush )
+          export FLUSH=yes
+	  shift
+          ;;
+        --etf )
+          export QDISC=etf
+	  shift
+          ;;
+        --fq )
+          export QDISC=fq
+	  shift
+          ;;
+        --delta )
+          export DELTA=$2
+	  shift 2
+          ;;
+        --offload )
+          export OFFLOAD=yes
+	  shift
+          ;;
+        --dummy )
+          export CREATE=dummy
+	  shift
+          ;;
+        --veth )
+          export CREATE=veth
+	  shift
+          ;;
+        --ip )
+          export IPADDR=$2
+	  shift 2
+          ;;
+	-- )
+	  shift
+	  break
+	  ;;
+        -h | --help )
+          usage;
+	  exit 0
+	  ;;
+	* )
+	  shift
+	  break
+	  ;;
+    esac
+done
+
+if [ -z "$DEV" ]; then
+    usage
+    err 2 "Please specify device"
+fi
+
+function call_ip() {
+    if [[ -n "$VERBOSE" ]]; then
+	echo "ip $@"
+    fi
+    if [[ -n "$DRYRUN" ]]; then
+	return
+    fi
+    ip "$@" || err 4 "Exec error($?) occurred cmd: \"ip $@\""
+}
+
+function create_device()
+{
+    local device="$1"
+    if [[ -e /sys/class/net/$device ]]; then
+	info "Device $device already exist, not creating"
+	return
+    fi
+    case "$CREATE" in
+	dummy )
+	    call_ip link add $device type dummy
+	    ;;
+	veth )
+	    call_ip link add $device type veth peer name ${device}-peer
+	    call_ip link set ${device}-peer up
+	    ;;
+    esac
+    if [[ -n "$IPADDR" ]]; then
+	call_ip addr add $IPADDR dev $device
+    fi
+    call_ip link set $device up
+}
+
+function txtime_qdisc_setup()
+{
+    local device="$1"
+
+    if [[ "$QDISC" == "etf" ]]; then
+	local offload=""
+	if [[ -n "$OFFLOAD" ]]; then
+	    offload="offload"
+	fi
+	info "Setup ETF qdisc (CLOCK_TAI) delta:$DELTA on device: $device"
+	call_tc qdisc replace dev $device root etf \
+	    clockid CLOCK_TAI delta $DELTA $offload
+    else
+	info "Setup FQ qdisc (CLOCK_MONOTONIC) on device: $device"
+	call_tc qdisc replace dev $device root fq
+    fi
+}
+
+if [[ -n "$FLUSH" ]]; then
+    info "Flush root qdisc on device: $DEV"
+    call_tc_allow_fail qdisc del dev $DEV root
+    if [[ -n "$CREATE" ]]; then
+	call_ip link del $DEV
+    fi
+    exit 0
+fi
+
+if [[ -n "$CREATE" ]]; then
+    create_device $DEV
+fi
+
+txtime_qdisc_setup $DEV
+
+if [[ -n "$VERBOSE" ]]; then
+    call_tc -s qdisc show dev $DEV
+fi
+echo "Use: udp_pacer --txtime=$QDISC (packets must route via $DEV)"